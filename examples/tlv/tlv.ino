@@ -45,6 +45,11 @@ void setup()
         Serial.println(childNode->getTag(), HEX);
     }
     TLVS::printTLV(tlvNode);
+
+    // Dump the same TLVs as JSON
+    TLVDump dump(Serial, TLVDump::FORMAT_JSON);
+    dump.dump(tlvs);
+    Serial.println();
 }
 
 void loop() {
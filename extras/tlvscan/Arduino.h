@@ -0,0 +1,52 @@
+//
+// Arduino.h - Host stand-in for the Arduino core
+//
+// Copyright (c) 2025 James Wanderer
+//
+// Provides the small part of the Arduino API used by tlv.cpp
+// so the library builds into host tools on Linux.
+//
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Flash is ordinary memory on the host
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+// Output sink, subset of the Arduino Print class
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+        size_t count = 0;
+        while (size-- > 0) {
+            count += write(*buffer++);
+        }
+        return count;
+    }
+    size_t write(const char *buffer, size_t size)
+    {
+        return write((const uint8_t *) buffer, size);
+    }
+};
+
+// Serial output goes to stdout
+class HostSerial : public Print {
+public:
+    size_t write(uint8_t value);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+};
+
+extern HostSerial Serial;
+
+#endif
@@ -0,0 +1,470 @@
+//
+// tlvscan.cpp - Analyze capture files of concatenated TLV records
+//
+// Copyright (c) 2025 James Wanderer
+//
+// Memory maps a capture and decodes each top level TLV in place with
+// the TLV library. Values are never copied out of the mapping.
+//
+//  tlvscan [-x] <capture> count            Number of records
+//  tlvscan [-x] <capture> tags             Count of each tag, all levels
+//  tlvscan [-x] <capture> path 6F/A5/50    Values of TLVs at a tag path
+//
+// With -x, queries use a sidecar index <capture>.idx holding record
+// offsets and TLV positions. The index is written by the first query and
+// reused while the capture size and modify time match, so later queries
+// skip parsing. The index takes 10 bytes per record and 8 bytes per TLV,
+// which is larger than the capture when most TLVs are small.
+//
+// Build on Linux:
+//  g++ -O2 -I extras/tlvscan -I src -o tlvscan extras/tlvscan/tlvscan.cpp src/tlv.cpp
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "tlv.h"
+
+HostSerial Serial;
+
+size_t HostSerial::write(uint8_t value)
+{
+    return fwrite(&value, 1, 1, stdout);
+}
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size)
+{
+    return fwrite(buffer, 1, size, stdout);
+}
+
+
+//
+// Sidecar index layout, host byte order.
+// Header, then record_count record offsets (uint64_t), then node_count
+// IndexNodes, then record_count node counts (uint16_t).
+//
+static const char INDEX_MAGIC[8] = "TLVIDX2";
+
+struct IndexHeader {
+    char magic[8];
+    uint64_t file_size;     // Capture size when indexed
+    int64_t file_mtime;     // Capture modify time when indexed
+    int64_t file_mtime_nsec;
+    uint64_t record_count;
+    uint64_t node_count;
+    uint64_t error_count;   // Records that could not be decoded
+};
+
+// Deepest TLV nesting that can be indexed, 1 == only top level TLVs
+static const uint16_t INDEX_MAX_DEPTH = 256;
+
+// One TLV, in depth first order within a record.
+// A record is a header and a value of at most MAX_DATA_LENGTH bytes,
+// so value offsets fit 24 bits and a record has under 64K TLVs.
+struct IndexNode {
+    uint16_t tag;
+    uint16_t value_length;
+    uint32_t value_offset : 24; // Offset of the value from the record start
+    uint32_t depth : 8;         // 0 == top level
+};
+
+// Record offsets and TLVs collected by a scan
+struct Index {
+    std::vector<uint64_t> offsets;
+    std::vector<uint16_t> node_counts;
+    std::vector<IndexNode> nodes;
+};
+
+
+//
+// A memory mapped, read only file
+//
+struct MappedFile {
+    const uint8_t *data;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+};
+
+static bool mapFile(const char *name, MappedFile *file)
+{
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    file->size = st.st_size;
+    file->mtime = st.st_mtim.tv_sec;
+    file->mtime_nsec = st.st_mtim.tv_nsec;
+    file->data = NULL;
+
+    if (file->size > 0) {
+        void *addr = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(addr, file->size, MADV_SEQUENTIAL);
+        file->data = (const uint8_t *) addr;
+    }
+    close(fd);
+    return true;
+}
+
+static void unmapFile(MappedFile *file)
+{
+    if (file->data != NULL) {
+        munmap((void *) file->data, file->size);
+        file->data = NULL;
+    }
+}
+
+
+//
+// Query state and results
+//
+static const int COMMAND_COUNT = 0;
+static const int COMMAND_TAGS = 1;
+static const int COMMAND_PATH = 2;
+
+struct Query {
+    int command;
+    std::vector<uint16_t> path;
+    std::vector<bool> matched;      // Path matched down to each depth
+    std::vector<uint64_t> tag_counts;
+    uint64_t record_count;
+    uint64_t error_count;
+};
+
+//
+// Print a value as hex, formatted in blocks
+static void printValue(const uint8_t *value, size_t length)
+{
+    char str[64 * 2 + 1];
+    for (size_t i = 0; i < length; i += 64) {
+        size_t count = length - i;
+        if (count > 64) {
+            count = 64;
+        }
+        size_t str_length = TLVS::binToHex(value + i, count, str, sizeof(str));
+        fwrite(str, 1, str_length, stdout);
+    }
+}
+
+//
+// Apply the query to the TLVs of one record
+static void queryRecord(Query &query, uint64_t record_no, const uint8_t *record,
+                        const IndexNode *nodes, size_t count)
+{
+    query.record_count++;
+    if (query.command == COMMAND_COUNT) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const IndexNode &node = nodes[i];
+
+        if (query.command == COMMAND_TAGS) {
+            query.tag_counts[node.tag]++;
+            continue;
+        }
+
+        // Track if the chain of parent tags matches the path
+        size_t depth = node.depth;
+        if (depth >= query.path.size()) {
+            continue;
+        }
+        query.matched[depth] = (node.tag == query.path[depth]) &&
+                               (depth == 0 || query.matched[depth - 1]);
+        if (query.matched[depth] && depth == query.path.size() - 1) {
+            printf("%llu ", (unsigned long long) record_no);
+            printValue(record + node.value_offset, node.value_length);
+            printf("\n");
+        }
+    }
+}
+
+//
+// Add index entries for a decoded TLV and children
+static void indexNode(const TLVNode *node, const uint8_t *record, uint16_t depth,
+                      std::vector<IndexNode> &nodes)
+{
+    IndexNode entry;
+    const uint8_t *value = node->getEncoded() + node->getEncodedLength() - node->getValueLength();
+    entry.tag = node->getTag();
+    entry.value_offset = value - record;
+    entry.value_length = node->getValueLength();
+    entry.depth = depth;
+    nodes.push_back(entry);
+
+    for (TLVNode *child = node->firstChild(); child != NULL; child = node->nextChild(child)) {
+        indexNode(child, record, depth + 1, nodes);
+    }
+}
+
+//
+// Find the length of the record at offset.
+// Returns 0 if the TLV header is bad or runs past the end of the file.
+static size_t recordLength(const MappedFile &file, uint64_t offset)
+{
+    int error = TLVS::ERROR_NONE;
+    uint64_t remaining = file.size - offset;
+    ReadBuffer header(file.data + offset, remaining < 8 ? remaining : 8);
+
+    TLVNode::parseTag(header, &error);
+    if (error != TLVS::ERROR_NONE) {
+        return 0;
+    }
+    uint16_t len = TLVNode::parseLength(header, &error);
+    if (error != TLVS::ERROR_NONE || header.pos + len > remaining) {
+        return 0;
+    }
+    return header.pos + len;
+}
+
+//
+// Decode every record in the capture and apply the query.
+// Fill in the index if provided.
+static void scanCapture(const MappedFile &file, Query &query, Index *index)
+{
+    TLVS tlvs;
+    std::vector<IndexNode> nodes;
+    uint64_t offset = 0;
+    uint64_t record_no = 0;
+
+    while (offset < file.size) {
+        // Skip zero padding between records
+        if (file.data[offset] == 0) {
+            offset++;
+            continue;
+        }
+
+        size_t length = recordLength(file, offset);
+        if (length == 0) {
+            // Can't find the next record boundary
+            fprintf(stderr, "Bad TLV header at offset %llu, stopping\n",
+                    (unsigned long long) offset);
+            query.error_count++;
+            break;
+        }
+
+        // The header parse limits values to MAX_DATA_LENGTH bytes,
+        // so the record length may be a few bytes more.
+        const uint8_t *record = file.data + offset;
+        TLVInfo info;
+        if (TLVS::validateTLVs(record, length, &info) != TLVS::ERROR_NONE ||
+            info.max_depth > INDEX_MAX_DEPTH) {
+            query.error_count++;
+            offset += length;
+            continue;
+        }
+
+        // Decode in place, values point into the mapping
+        tlvs.decodeTLVs(record, length);
+        nodes.clear();
+        for (TLVNode *node = tlvs.firstTLV(); node != NULL; node = tlvs.nextTLV(node)) {
+            indexNode(node, record, 0, nodes);
+        }
+
+        if (index != NULL) {
+            index->offsets.push_back(offset);
+            index->node_counts.push_back(nodes.size());
+            index->nodes.insert(index->nodes.end(), nodes.begin(), nodes.end());
+        }
+
+        queryRecord(query, record_no++, record, nodes.data(), nodes.size());
+        offset += length;
+    }
+}
+
+//
+// Write the sidecar index
+static bool writeIndex(const char *name, const MappedFile &file, const Query &query,
+                       const Index &index)
+{
+    IndexHeader header;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.file_size = file.size;
+    header.file_mtime = file.mtime;
+    header.file_mtime_nsec = file.mtime_nsec;
+    header.record_count = index.offsets.size();
+    header.node_count = index.nodes.size();
+    header.error_count = query.error_count;
+    const std::vector<uint64_t> &offsets = index.offsets;
+    const std::vector<IndexNode> &nodes = index.nodes;
+    const std::vector<uint16_t> &counts = index.node_counts;
+
+    FILE *out = fopen(name, "wb");
+    if (out == NULL) {
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), out) == offsets.size();
+    ok = ok && fwrite(nodes.data(), sizeof(IndexNode), nodes.size(), out) == nodes.size();
+    ok = ok && fwrite(counts.data(), sizeof(uint16_t), counts.size(), out) == counts.size();
+    ok = (fclose(out) == 0) && ok;
+    if (!ok) {
+        unlink(name);
+    }
+    return ok;
+}
+
+//
+// Map the sidecar index and check it matches the capture.
+static bool loadIndex(const char *name, const MappedFile &file, MappedFile *index)
+{
+    if (!mapFile(name, index)) {
+        return false;
+    }
+
+    const IndexHeader *header = (const IndexHeader *) index->data;
+    bool ok = index->size >= sizeof(IndexHeader) &&
+              memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+              header->file_size == file.size &&
+              header->file_mtime == file.mtime &&
+              header->file_mtime_nsec == file.mtime_nsec &&
+              index->size == sizeof(IndexHeader) +
+                             header->record_count * (sizeof(uint64_t) + sizeof(uint16_t)) +
+                             header->node_count * sizeof(IndexNode);
+    if (!ok) {
+        unmapFile(index);
+    }
+    return ok;
+}
+
+//
+// Apply the query using the index, without parsing the capture.
+static void scanIndex(const MappedFile &file, const MappedFile &index, Query &query)
+{
+    const IndexHeader *header = (const IndexHeader *) index.data;
+    const uint64_t *offsets = (const uint64_t *) (header + 1);
+    const IndexNode *nodes = (const IndexNode *) (offsets + header->record_count);
+    const uint16_t *counts = (const uint16_t *) (nodes + header->node_count);
+
+    query.error_count = header->error_count;
+    if (query.command == COMMAND_COUNT) {
+        query.record_count = header->record_count;
+        return;
+    }
+
+    uint64_t first = 0;
+    for (uint64_t i = 0; i < header->record_count; i++) {
+        if (first + counts[i] > header->node_count) {
+            break;
+        }
+        queryRecord(query, i, file.data + offsets[i], nodes + first, counts[i]);
+        first += counts[i];
+    }
+}
+
+//
+// Parse a path of hex tags: 6F/A5/50
+static bool parsePath(const char *str, std::vector<uint16_t> &path)
+{
+    while (*str != '\0') {
+        char *end;
+        unsigned long tag = strtoul(str, &end, 16);
+        if (end == str || tag == 0 || tag > 0xffff || (*end != '/' && *end != '\0')) {
+            return false;
+        }
+        path.push_back(tag);
+        str = (*end == '/') ? end + 1 : end;
+    }
+    return !path.empty();
+}
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: tlvscan [-x] <capture> count\n"
+            "       tlvscan [-x] <capture> tags\n"
+            "       tlvscan [-x] <capture> path <tag>/<tag>/...\n"
+            "  -x   use or create the index <capture>.idx\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    bool use_index = false;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-x") == 0) {
+        use_index = true;
+        arg++;
+    }
+    if (argc - arg < 2) {
+        usage();
+    }
+    const char *capture = argv[arg];
+    const char *command = argv[arg + 1];
+
+    Query query;
+    query.record_count = 0;
+    query.error_count = 0;
+    if (strcmp(command, "count") == 0 && argc - arg == 2) {
+        query.command = COMMAND_COUNT;
+    } else if (strcmp(command, "tags") == 0 && argc - arg == 2) {
+        query.command = COMMAND_TAGS;
+        query.tag_counts.resize(0x10000);
+    } else if (strcmp(command, "path") == 0 && argc - arg == 3) {
+        query.command = COMMAND_PATH;
+        if (!parsePath(argv[arg + 2], query.path)) {
+            fprintf(stderr, "Bad tag path: %s\n", argv[arg + 2]);
+            return 2;
+        }
+        query.matched.resize(query.path.size());
+    } else {
+        usage();
+    }
+
+    MappedFile file;
+    if (!mapFile(capture, &file)) {
+        perror(capture);
+        return 1;
+    }
+
+    if (use_index) {
+        MappedFile index;
+        std::string index_name = std::string(capture) + ".idx";
+        if (loadIndex(index_name.c_str(), file, &index)) {
+            scanIndex(file, index, query);
+            unmapFile(&index);
+        } else {
+            Index new_index;
+            scanCapture(file, query, &new_index);
+            if (!writeIndex(index_name.c_str(), file, query, new_index)) {
+                perror(index_name.c_str());
+            }
+        }
+    } else {
+        scanCapture(file, query, NULL);
+    }
+
+    if (query.command == COMMAND_COUNT) {
+        printf("%llu\n", (unsigned long long) query.record_count);
+    } else if (query.command == COMMAND_TAGS) {
+        for (size_t tag = 0; tag < query.tag_counts.size(); tag++) {
+            if (query.tag_counts[tag] != 0) {
+                printf("%X %llu\n", (unsigned) tag, (unsigned long long) query.tag_counts[tag]);
+            }
+        }
+    }
+    if (query.error_count != 0) {
+        fprintf(stderr, "%llu records could not be decoded\n",
+                (unsigned long long) query.error_count);
+    }
+
+    unmapFile(&file);
+    return 0;
+}
@@ -9,6 +9,45 @@
 
 #include "tlv.h"
 
+//
+// Lookup tables for BCD conversion
+//
+
+// Value of a packed BCD byte, 0xff if either nibble is not a digit
+#define BCD_INVALID 0xff
+static const uint8_t bcd_values[256] PROGMEM = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    80, 81, 82, 83, 84, 85, 86, 87, 88, 89, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    90, 91, 92, 93, 94, 95, 96, 97, 98, 99, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+// Packed BCD byte for 0 - 99
+static const uint8_t bcd_bytes[100] PROGMEM = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+};
+
 //
 // TLVS: Represents a list of TLVs
 //
@@ -22,24 +61,108 @@
 TLVS::TLVS()
 {
     error_value = 0;
+    frozen = false;
+    hashing = false;
     // Dummy is always constructed. 
     // Set to avoid error flag when encoding.
     dummy_node.tag = TLV_TYPE_MASK;
 }
 
+TLVS::TLVS(TLVS &&other)
+{
+    error_value = 0;
+    frozen = false;
+    hashing = false;
+    dummy_node.tag = TLV_TYPE_MASK;
+    takeContents(other);
+}
+
+TLVS& TLVS::operator=(TLVS &&other)
+{
+    if (this != &other) {
+        reset();
+        takeContents(other);
+    }
+    return *this;
+}
+
+//
+// Re-link the TLVs of other under our dummy node.
+// Assumes this TLVS is empty.
+void TLVS::takeContents(TLVS &other)
+{
+    error_value = other.error_value;
+    frozen = other.frozen;
+    hashing = other.hashing;
+    dummy_node.child = other.dummy_node.child;
+    for (TLVNode *node = dummy_node.child; node != NULL; node = node->next) {
+        node->parent = &dummy_node;
+    }
+    dummy_node.clearCachedSize();
+
+    other.error_value = 0;
+    other.frozen = false;
+    other.dummy_node.child = NULL;
+    other.dummy_node.clearCachedSize();
+}
+
 //
 // Reset and free contents for TLVS re-use
 void TLVS::reset()
 {
     error_value = 0;
+    frozen = false;
     dummy_node.freeContents();
 }
 
-int TLVS::errorValue()
+int TLVS::errorValue() const
 {
     return error_value;
 }
 
+//
+// Calculate and cache all lengths so reads don't modify the nodes.
+void TLVS::freeze()
+{
+    dummy_node.cacheSizes();
+    if (hashing) {
+        dummy_node.cacheHashes();
+    }
+    frozen = true;
+}
+
+void TLVS::thaw()
+{
+    frozen = false;
+}
+
+bool TLVS::isFrozen() const
+{
+    return frozen;
+}
+
+//
+// Save hashes so later compares don't read the values
+void TLVS::cacheHashes()
+{
+    if (frozen) {
+        markError(ERROR_FROZEN);
+        return;
+    }
+    dummy_node.cacheSizes();
+    dummy_node.cacheHashes();
+}
+
+void TLVS::setHashing(bool enable)
+{
+    hashing = enable;
+}
+
+uint32_t TLVS::getHash() const
+{
+    return dummy_node.getHash();
+}
+
 TLVNode* TLVS::addTLV(uint16_t tag)
 {
     return  addTLV(NULL, tag);
@@ -47,6 +170,10 @@ TLVNode* TLVS::addTLV(uint16_t tag)
 
 TLVNode* TLVS::addTLV(TLVNode* parent, uint16_t tag)
 {
+    if (frozen) {
+        markError(ERROR_FROZEN);
+        return NULL;
+    }
     TLVNode *node = new TLVNode(tag, 0);
     if (parent == NULL) {
         // Add top level TLV
@@ -73,6 +200,10 @@ TLVNode* TLVS::addTLVCopy(uint16_t tag, const uint8_t *value, uint16_t value_len
 
 TLVNode* TLVS::addTLV(TLVNode *parent, uint16_t tag, const uint8_t *value, uint16_t value_length)
 {
+    if (frozen) {
+        markError(ERROR_FROZEN);
+        return NULL;
+    }
     TLVNode* node = new TLVNode(tag, value_length);
     node->value = value;
     node->value_allocated = false;
@@ -102,6 +233,10 @@ TLVNode* TLVS::addTLVCopy(TLVNode *parent, uint16_t tag, const uint8_t *value, u
     }
     
     TLVNode* node = this->addTLV(parent, tag, value_copy, value_length);
+    if (node == NULL) {
+        free(value_copy);
+        return NULL;
+    }
 
     if (node->value != NULL) {
         // Important to note this after the call to addTLV
@@ -111,45 +246,393 @@ TLVNode* TLVS::addTLVCopy(TLVNode *parent, uint16_t tag, const uint8_t *value, u
     return node;
 }
 
+TLVNode* TLVS::addTLV_P(uint16_t tag, const uint8_t *value, uint16_t value_length)
+{
+    return addTLV_P(NULL, tag, value, value_length);
+}
+
+TLVNode* TLVS::addTLV_P(TLVNode *parent, uint16_t tag, const uint8_t *value, uint16_t value_length)
+{
+    TLVNode* node = addTLV(parent, tag, value, value_length);
+    if (node != NULL) {
+        node->value_flash = true;
+    }
+    return node;
+}
+
+//
+// Encode an integer big endian, low byte last
+TLVNode* TLVS::addTLVUInt(TLVNode *parent, uint16_t tag, uint64_t value, uint8_t length)
+{
+    uint8_t bytes[8];
+    if (length == 0 || length > sizeof(bytes)) {
+        return NULL;
+    }
+    for (uint8_t i = length; i > 0; i--) {
+        bytes[i - 1] = value & 0xff;
+        value >>= 8;
+    }
+    if (value != 0) {
+        // Doesn't fit in length bytes
+        return NULL;
+    }
+    return addTLVCopy(parent, tag, bytes, length);
+}
+
+//
+// Encode two digits per byte, working from the last byte
+TLVNode* TLVS::addTLVBCD(TLVNode *parent, uint16_t tag, uint64_t value, uint8_t length)
+{
+    uint8_t bytes[9];
+    if (length == 0 || length > sizeof(bytes)) {
+        return NULL;
+    }
+    for (uint8_t i = length; i > 0; i--) {
+        bytes[i - 1] = pgm_read_byte(&bcd_bytes[value % 100]);
+        value /= 100;
+    }
+    if (value != 0) {
+        // More digits than fit in length bytes
+        return NULL;
+    }
+    return addTLVCopy(parent, tag, bytes, length);
+}
+
+TLVNode* TLVS::addTLVCompressedNumeric(TLVNode *parent, uint16_t tag, const char *digits, uint8_t length)
+{
+    uint8_t bytes[16];
+    if (length == 0 || length > sizeof(bytes)) {
+        return NULL;
+    }
+    memset(bytes, 0xff, length);
+    for (size_t i = 0; digits[i] != '\0'; i++) {
+        if (i >= (size_t) length * 2 || digits[i] < '0' || digits[i] > '9') {
+            return NULL;
+        }
+        uint8_t digit = digits[i] - '0';
+        if (i & 1) {
+            bytes[i / 2] = (bytes[i / 2] & 0xf0) | digit;
+        } else {
+            bytes[i / 2] = (digit << 4) | 0x0f;
+        }
+    }
+    return addTLVCopy(parent, tag, bytes, length);
+}
+
+//
+// Encode the TLV into storage and use the result for later encodes
+bool TLVS::cacheTLV(TLVNode *node, uint8_t *storage, size_t storage_size)
+{
+    if (frozen) {
+        markError(ERROR_FROZEN);
+        return false;
+    }
+    if (node == NULL) {
+        return false;
+    }
+    if (node->encoded != NULL && !node->encoded_allocated) {
+        // Decoded and unchanged, already have the encoding
+        return true;
+    }
+
+    node->clearEncoded();
+    node->cacheSizes();
+    size_t size = node->getTotalBytes();
+
+    bool allocated = false;
+    if (storage == NULL) {
+        storage = (uint8_t*) malloc(size);
+        storage_size = size;
+        allocated = true;
+    }
+    if (storage == NULL || storage_size < size) {
+        return false;
+    }
+
+    // Check for errors from this encode, keep the first error reported
+    int saved_error = error_value;
+    error_value = ERROR_NONE;
+    WriteBuffer dataBuffer(storage, storage_size);
+    node->encodeTLVNode(this, dataBuffer);
+    int error = error_value;
+    error_value = saved_error;
+
+    if (error != ERROR_NONE) {
+        // Don't save a bad encoding for re-use
+        markError(error);
+        if (allocated) {
+            free(storage);
+        }
+        return false;
+    }
+
+    node->encoded = storage;
+    node->encoded_header = size - node->getValueLength();
+    node->encoded_allocated = allocated;
+    return true;
+}
+
+//
+// Unlink a TLV from source and link it in to this TLVS
+TLVNode* TLVS::moveTLV(TLVS &source, TLVNode *node, TLVNode *parent)
+{
+    if (frozen || source.frozen) {
+        markError(ERROR_FROZEN);
+        return NULL;
+    }
+    if (node == NULL || node == &source.dummy_node) {
+        return NULL;
+    }
+
+    // Check node belongs to source
+    TLVNode *root = node;
+    while (root->parent != NULL) {
+        root = root->parent;
+    }
+    if (root != &source.dummy_node) {
+        return NULL;
+    }
+
+    // Check parent belongs to us and is not part of the moved TLV
+    if (parent != NULL) {
+        for (root = parent; root->parent != NULL; root = root->parent) {
+            if (root == node) {
+                return NULL;
+            }
+        }
+        if (root != &dummy_node) {
+            return NULL;
+        }
+    }
+
+    node->parent->removeChild(node);
+
+    if (parent == NULL) {
+        dummy_node.addChild(node);
+    } else {
+        if (!Tag::tagConstructed(parent->tag)) {
+            markError(ERROR_PRIMIVE_TYPE);
+        }
+        parent->addChild(node);
+    }
+    return node;
+}
 
 //
 // Decode TLVs from the buffer
 void TLVS::decodeTLVs(const uint8_t *buffer, size_t buffer_size)
 {
+    if (frozen) {
+        markError(ERROR_FROZEN);
+        return;
+    }
     ReadBuffer dataBuffer(buffer, buffer_size);
     reset();
     dummy_node.decodeTLVNode(this, dataBuffer);
+    if (hashing) {
+        dummy_node.cacheHashes();
+    }
 }
 
 //
 // Encode TLVs to the buffer
-size_t TLVS::encodeTLVs(uint8_t *buffer, size_t buffer_size)
+size_t TLVS::encodeTLVs(uint8_t *buffer, size_t buffer_size, size_t *required_size)
 {
     WriteBuffer dataBuffer(buffer, buffer_size);
-    TLVNode *node = dummy_node.child;
+    TLVNode *node;
+
+    // Calculate lengths once rather than per node
+    size_t size = encodedSize();
+    if (required_size != NULL) {
+        *required_size = size;
+    }
+    if (size > buffer_size) {
+        // A size query with a NULL buffer is not an error
+        if (buffer != NULL) {
+            markError(ERROR_BUFFER_SIZE);
+        }
+        return 0;
+    }
+
     for (node = dummy_node.child; node != NULL; node = node->next) {
         node->encodeTLVNode(this, dataBuffer);
     }
     return dataBuffer.pos;
 }
 
+//
+// Check the buffer holds well formed TLVs.
+// Follows the same rules as decodeTLVs, but stops at the first error.
+int TLVS::validateTLVs(const uint8_t *buffer, size_t buffer_size, TLVInfo *info)
+{
+    TLVInfo local_info;
+    if (info == NULL) {
+        info = &local_info;
+    }
+    info->error = ERROR_NONE;
+    info->error_offset = 0;
+    info->node_count = 0;
+    info->max_depth = 0;
+
+    ReadBuffer dataBuffer(buffer, buffer_size);
+    validateHelper(dataBuffer, 1, info);
+    return info->error;
+}
+
+//
+// Check the TLVs at one level of nesting.
+// Returns false on the first error.
+bool TLVS::validateHelper(ReadBuffer &buffer, uint16_t depth, TLVInfo *info)
+{
+    int error = ERROR_NONE;
+    uint16_t tag, len;
+    size_t header_start;
+
+    while (TLVNode::parseHeader(buffer, &tag, &len, &header_start, &error)) {
+        info->node_count++;
+        if (depth > info->max_depth) {
+            info->max_depth = depth;
+        }
+
+        if (Tag::tagConstructed(tag)) {
+            ReadBuffer valueBuffer(buffer, len);
+            if (!validateHelper(valueBuffer, depth + 1, info)) {
+                return false;
+            }
+        }
+        buffer.seek(len);
+    }
+    if (error != ERROR_NONE) {
+        info->error = error;
+        info->error_offset = header_start;
+        return false;
+    }
+    return true;
+}
+
+//
+// Size of all TLVs once encoded
+size_t TLVS::encodedSize()
+{
+    size_t size = 0;
+    dummy_node.cacheSizes();
+    for (TLVNode *node = dummy_node.child; node != NULL; node = node->next) {
+        size += node->getTotalBytes();
+    }
+    return size;
+}
+
+//
+// Encode a set of TLVS into a single buffer
+size_t TLVS::encodeBatch(TLVS *batch, size_t count, uint8_t *buffer, size_t buffer_size,
+                         int framing, int *error)
+{
+    size_t pos = 0;
+    size_t frame_bytes = (framing == FRAME_LENGTH) ? 2 : 0;
+    int result = ERROR_NONE;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t size = batch[i].encodedSize();
+        if (frame_bytes + size > buffer_size - pos) {
+            result = ERROR_BUFFER_SIZE;
+            break;
+        }
+        if (framing == FRAME_LENGTH) {
+            if (size > MAX_DATA_LENGTH) {
+                result = ERROR_LONG_DATA;
+                break;
+            }
+            buffer[pos++] = (size >> 8) & 0xff;
+            buffer[pos++] = size & 0xff;
+        }
+
+        // Collect errors from this encode only, without changing the
+        // error value of the TLVS, which may be frozen and shared.
+        TLVS errors;
+        WriteBuffer dataBuffer(buffer + pos, size);
+        for (TLVNode *node = batch[i].dummy_node.child; node != NULL; node = node->next) {
+            node->encodeTLVNode(&errors, dataBuffer);
+        }
+        pos += dataBuffer.pos;
+
+        if (result == ERROR_NONE) {
+            result = errors.errorValue();
+        }
+    }
+
+    if (error != NULL) {
+        *error = result;
+    }
+    return pos;
+}
+
+//
+// Find the records in a batch buffer
+size_t TLVS::decodeBatch(const uint8_t *buffer, size_t buffer_size, int framing,
+                         TLVRecord *records, size_t max_records, int *error)
+{
+    ReadBuffer dataBuffer(buffer, buffer_size);
+    size_t count = 0;
+    int result = ERROR_NONE;
+
+    while (not dataBuffer.atEnd()) {
+        size_t start = dataBuffer.pos;
+        size_t length;
+
+        if (framing == FRAME_LENGTH) {
+            uint8_t high, low;
+            if (!dataBuffer.getByte(high) || !dataBuffer.getByte(low)) {
+                result = ERROR_END_DATA;
+                break;
+            }
+            start = dataBuffer.pos;
+            length = (high << 8) | low;
+        } else {
+            // Record is the next top level TLV
+            uint16_t tag, len;
+            if (!TLVNode::parseHeader(dataBuffer, &tag, &len, &start, &result)) {
+                break;
+            }
+            length = dataBuffer.pos - start + len;
+        }
+
+        if (start + length > buffer_size) {
+            result = ERROR_END_DATA;
+            break;
+        }
+        if (count == max_records) {
+            result = ERROR_BUFFER_SIZE;
+            break;
+        }
+        records[count].data = buffer + start;
+        records[count].length = length;
+        count++;
+        dataBuffer.pos = start + length;
+    }
+
+    if (error != NULL) {
+        *error = result;
+    }
+    return count;
+}
+
 
-TLVNode* TLVS::firstTLV()
+TLVNode* TLVS::firstTLV() const
 {
     return dummy_node.firstChild();
 }
 
-TLVNode* TLVS::nextTLV(TLVNode* child)
+TLVNode* TLVS::nextTLV(const TLVNode* child) const
 {
     return dummy_node.nextChild(child);
 }
 
-TLVNode* TLVS::findTLV(uint16_t tag)
+TLVNode* TLVS::findTLV(uint16_t tag) const
 {
     return findTLVHelper(&dummy_node, tag);
 }
 
-TLVNode* TLVS::findNextTLV(TLVNode* node)
+TLVNode* TLVS::findNextTLV(const TLVNode* node) const
 {
     if (node == NULL) {
         return NULL;
@@ -157,124 +640,261 @@ TLVNode* TLVS::findNextTLV(TLVNode* node)
     return findTLVHelper(node, node->tag);
 }
 
-TLVNode* TLVS::findTLVHelper(TLVNode* node, uint16_t tag)
+TLVNode* TLVS::findTLVHelper(const TLVNode* start, uint16_t tag)
 {
-    while (node != NULL) {
+    TLVNode *node = nextInTree(start);
+    while (node != NULL && node->getTag() != tag) {
+        node = nextInTree(node);
+    }
+    return node;
+}
 
-        // Move to next node
-        if (node->child != NULL) {
-            // Move to child
-            node = node->child;
-        } else if (node->next != NULL) {
-            // Check next sibling
-            node = node->next;
-        } else {
-            // Next sibling of a parent
-            do {
-                node = node->parent;
-            } while (node != NULL && node->next == NULL);
-            
-            if (node != NULL) {
-                node = node->next;
+//
+// Return the next node in a depth first walk of the tree.
+// NULL at the end of the tree.
+TLVNode* TLVS::nextInTree(const TLVNode* node)
+{
+    if (node->child != NULL) {
+        // Move to child
+        return node->child;
+    }
+
+    // Next sibling, or the next sibling of a parent
+    while (node != NULL && node->next == NULL) {
+        node = node->parent;
+    }
+    if (node == NULL) {
+        return NULL;
+    }
+    return node->next;
+}
+
+//
+// Report the differences between two TLVS
+size_t TLVS::diffTLVs(const TLVS &a, const TLVS &b, TLVDiffCallback callback, void *context)
+{
+    return diffHelper(&a.dummy_node, &b.dummy_node, callback, context);
+}
+
+//
+// Compare the child TLVs of a and b in order.
+// TLVs with the same tag and hash are taken as the same.
+// A TLV with a tag missing from the rest of the other list is reported
+// alone, so one added or removed TLV doesn't offset the rest.
+size_t TLVS::diffHelper(const TLVNode *a, const TLVNode *b,
+                        TLVDiffCallback callback, void *context)
+{
+    size_t count = 0;
+    const TLVNode *node_a = a->child;
+    const TLVNode *node_b = b->child;
+
+    while (node_a != NULL || node_b != NULL) {
+        if (node_a != NULL && node_b != NULL && node_a->tag == node_b->tag) {
+            if (node_a->getHash() == node_b->getHash()) {
+                // Same contents, skip
+            } else if (node_a->child != NULL && node_b->child != NULL) {
+                count += diffHelper(node_a, node_b, callback, context);
+            } else {
+                count++;
+                if (callback != NULL) {
+                    callback(node_a, node_b, context);
+                }
             }
+            node_a = node_a->next;
+            node_b = node_b->next;
+            continue;
         }
-        
-        if (node != NULL && node->getTag() == tag) {
-            return node;
+
+        // Only in a if the tag is not coming up in b, or the
+        // tag in b is coming up in a. Otherwise only in b.
+        bool only_a = (node_b == NULL);
+        if (node_a != NULL && node_b != NULL) {
+            only_a = findSibling(node_b, node_a->tag) == NULL ||
+                     findSibling(node_a->next, node_b->tag) != NULL;
+        }
+
+        count++;
+        if (only_a) {
+            if (callback != NULL) {
+                callback(node_a, NULL, context);
+            }
+            node_a = node_a->next;
+        } else {
+            if (callback != NULL) {
+                callback(NULL, node_b, context);
+            }
+            node_b = node_b->next;
         }
     }
-    return NULL;
+    return count;
+}
+
+//
+// Return node or the first following sibling with the tag, NULL if none
+const TLVNode* TLVS::findSibling(const TLVNode *node, uint16_t tag)
+{
+    while (node != NULL && node->tag != tag) {
+        node = node->next;
+    }
+    return node;
+}
+
+//
+// Lookup tables for hex conversion
+//
+static const char hex_digits[16] PROGMEM = {
+    '0', '1', '2', '3', '4', '5', '6', '7',
+    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+// Value of an ASCII hex digit, 0xff if not a hex digit
+#define HEX_INVALID 0xff
+static const uint8_t hex_values[128] PROGMEM = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,     // '0' - '7'
+    0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,     // '8' - '9'
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff,     // 'A' - 'F'
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff,     // 'a' - 'f'
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+static uint8_t hexValue(char c)
+{
+    if ((uint8_t) c & 0x80) {
+        return HEX_INVALID;
+    }
+    return pgm_read_byte(&hex_values[(uint8_t) c]);
 }
 
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+//
+// Print in chunks formatted into a local buffer.
 void TLVS::printHex(const uint8_t* data, size_t length)
 {
     if (data == NULL)
         return;
 
-    for (int i = 0; i < length; i++) {
+    // 16 bytes per write: "XX " each, plus null
+    char str[16 * 3 + 1];
+    for (size_t i = 0; i < length; i += 16) {
+        size_t count = length - i;
+        if (count > 16) {
+            count = 16;
+        }
+        size_t str_length = 0;
         if (i != 0) {
-            Serial.print(" ");
+            str[str_length++] = ' ';
         }
-        Serial.print(data[i] >> 4, HEX);
-        Serial.print(data[i] & 0xf, HEX);
+        str_length += binToHex(data + i, count, str + str_length, sizeof(str) - str_length, ' ');
+        Serial.write(str, str_length);
     }
 }
 
 void TLVS::printValue(const uint8_t* data, size_t length)
 {
-    if (data == NULL)
-        return;
+    TLVDump dumper(Serial);
+    dumper.putValue(data, length);
+}
 
-    bool ascii = true;
-    for (int i = 0; i < length; i++) {
-        if (data[i] < 32 || data[i] > 126) {
-            ascii = false;
-        }
-    }
 
-    if (ascii) {
-        for (int i = 0; i < length; i++) {
-            char buffer[3];
-            buffer[0] = (char) data[i];
-            buffer[1] = ' ';
-            buffer[2] = '\0';
-            Serial.print(buffer);
-        }
-    } else {
-        printHex(data, length);
-    }
+void TLVS::printTLV(const TLVNode* node, int indent, TLVTagName names)
+{
+    TLVDump dumper(Serial);
+    dumper.setTagNames(names);
+    dumper.dump(node, indent);
 }
 
+size_t TLVS::hexToBin(const char* str, uint8_t* buffer, size_t buffer_size)
+{
+    return hexToBin(str, strlen(str), buffer, buffer_size, NULL);
+}
 
-void TLVS::printTLV(TLVNode* node, int indent)
+size_t TLVS::hexToBin(const char* str, size_t str_length,
+                      uint8_t* buffer, size_t buffer_size, int *error)
 {
-    for (int i = 0; i < indent; i++)
-        Serial.print("    ");
+    size_t str_index = 0;
+    size_t buf_index = 0;
+    int result = ERROR_NONE;
 
-    if (node == NULL) {
-        Serial.println("NULL pointer for TLVNode....");
-        return;
-    }
+    while (str_index < str_length) {
+        if (isSpace(str[str_index])) {
+            str_index++;
+            continue;
+        }
 
-    Serial.print("Tag: ");
-    Serial.print(node->getTag(), HEX);
-    Serial.print(" Length: ");
-    Serial.println(node->getValueLength(), HEX);
-    TLVNode *child = node->firstChild();
-    if (child == NULL) {
-        for (int i = 0; i <= indent; i++)
-            Serial.print("    ");
-        printValue(node->getValue(), node->getValueLength());
-        Serial.println("");
+        // Need two hex digits for a byte
+        if (str_index + 1 >= str_length) {
+            result = ERROR_BAD_HEX;
+            break;
+        }
+        uint8_t high = hexValue(str[str_index]);
+        uint8_t low = hexValue(str[str_index + 1]);
+        if (high == HEX_INVALID || low == HEX_INVALID) {
+            result = ERROR_BAD_HEX;
+            break;
+        }
+        if (buf_index >= buffer_size) {
+            result = ERROR_BUFFER_SIZE;
+            break;
+        }
+        buffer[buf_index++] = (high << 4) | low;
+        str_index += 2;
     }
 
-    while (child != NULL) {
-        printTLV(child, indent + 1);
-        child = node->nextChild(child);
+    if (error != NULL) {
+        *error = result;
     }
+    return buf_index;
 }
 
-size_t TLVS::hexToBin(const char* str, uint8_t* buffer, size_t buffer_size)
+size_t TLVS::binToHex(const uint8_t *data, size_t length,
+                      char *str, size_t str_size, char separator, int *error)
 {
-    char hex_str[3];
-    size_t count = strlen(str);
     size_t str_index = 0;
-    size_t buf_index = 0;
+    int result = ERROR_NONE;
+
+    // Each byte takes 2 digits plus a separator, except the last byte.
+    // Leave space for the null.
+    size_t max_bytes = 0;
+    if (separator != 0) {
+        max_bytes = str_size / 3;
+    } else if (str_size != 0) {
+        max_bytes = (str_size - 1) / 2;
+    }
+    if (length > max_bytes) {
+        result = ERROR_BUFFER_SIZE;
+        length = max_bytes;
+    }
 
-    while (str_index < count - 1) {
-        if (str[str_index] == ' ') {
-            str_index++;
-            continue;
+    for (size_t i = 0; i < length; i++) {
+        if (i != 0 && separator != 0) {
+            str[str_index++] = separator;
         }
-            
-        hex_str[0] = str[str_index++];
-        hex_str[1] = str[str_index++];
-        hex_str[2] = '\0';
-        long val = strtol(hex_str, NULL, 16);
-        if (buf_index < buffer_size)
-            buffer[buf_index++] = val & 0xff;
+        str[str_index++] = pgm_read_byte(&hex_digits[data[i] >> 4]);
+        str[str_index++] = pgm_read_byte(&hex_digits[data[i] & 0xf]);
     }
-    return buf_index;
+    if (str_size != 0) {
+        str[str_index] = '\0';
+    }
+
+    if (error != NULL) {
+        *error = result;
+    }
+    return str_index;
 }
 
 // 
@@ -297,10 +917,16 @@ TLVNode::TLVNode(uint16_t tag, uint16_t length)
     this->tag = tag;
     this->value_length = length;
     value = NULL;
+    encoded = NULL;
+    encoded_header = 0;
     next = NULL;
     child = NULL;
     parent = NULL;
     value_allocated = false;
+    value_flash = false;
+    encoded_allocated = false;
+    hash_valid = false;
+    hash_value = 0;
 }
 
 
@@ -316,6 +942,8 @@ void TLVNode::freeContents()
         value = NULL;
         value_allocated = false;
     }
+    clearEncoded();
+    hash_valid = false;
 
     // Cleanup kids
     while (child != NULL) {
@@ -393,7 +1021,11 @@ uint16_t TLVNode::parseLength(ReadBuffer &buffer, int *error)
     uint8_t byte;
     *error = TLVS::ERROR_NONE;
 
-    buffer.getByte(byte);
+    if (!buffer.getByte(byte)) {
+        // Tag without a length
+        *error = TLVS::ERROR_END_DATA;
+        return 0;
+    }
 
     if ((byte & 0x80) == 0) {
         // Short definite form
@@ -442,6 +1074,35 @@ int TLVNode::encodeLength(uint32_t length, WriteBuffer &buffer)
     return TLVS::ERROR_NONE;
 }
 
+//
+// Static function to find and parse the header of the next TLV
+bool TLVNode::parseHeader(ReadBuffer &buffer, uint16_t *tag, uint16_t *length,
+                          size_t *header_start, int *error)
+{
+    *error = TLVS::ERROR_NONE;
+
+    // Skip zeros to find the start of the TLV
+    while (not buffer.atEnd() && buffer.buffer[buffer.pos] == 0) {
+        buffer.seek(1);
+    }
+    *header_start = buffer.pos;
+    if (buffer.atEnd()) {
+        return false;
+    }
+
+    *tag = parseTag(buffer, error);
+    *length = 0;
+    if (*error == TLVS::ERROR_NONE) {
+        *length = parseLength(buffer, error);
+    }
+
+    // Ensure the reported length doesn't go past the end of the buffer
+    if (*error == TLVS::ERROR_NONE && buffer.pos + *length > buffer.buffer_size) {
+        *error = TLVS::ERROR_END_DATA;
+    }
+    return *error == TLVS::ERROR_NONE;
+}
+
 
 //
 // Decode a child TLV
@@ -459,6 +1120,9 @@ void TLVNode::decodeTLVNode(TLVS *tlvs, ReadBuffer &buffer)
             // Loop again to check.
             continue;
         }
+        // Track if the original encoding can be kept for the node
+        bool intact = (error == TLVS::ERROR_NONE);
+        size_t header_start = buffer.pos - Tag::numTagBytes(tag);
         if (error) {
             tlvs->markError(error);
         }
@@ -466,12 +1130,14 @@ void TLVNode::decodeTLVNode(TLVS *tlvs, ReadBuffer &buffer)
         uint16_t len = parseLength(buffer, &error) ;
         if (error) {
             tlvs->markError(error);
+            intact = false;
         }
 
         // Ensure the reported length doesn't send us past the end of the buffer
         if (buffer.pos + len > buffer.buffer_size) {
             tlvs->markError(TLVS::ERROR_END_DATA);
             len = buffer.buffer_size - buffer.pos;
+            intact = false;
         }
         TLVNode *node = tlvs->addTLV(this, tag, buffer.position(), len);
 
@@ -479,6 +1145,19 @@ void TLVNode::decodeTLVNode(TLVS *tlvs, ReadBuffer &buffer)
             ReadBuffer valueBuffer(buffer, len);
             node->decodeTLVNode(tlvs, valueBuffer);
         }
+
+        // Adding child TLVs clears the cached length and encoding,
+        // so record these once the children are decoded.
+        if (intact) {
+            node->encoded = buffer.buffer + header_start;
+            node->encoded_header = buffer.pos - header_start;
+            node->value_length = len;
+        }
+
+        // Children are complete and hashed, hash while the value is at hand
+        if (tlvs->hashing) {
+            node->cacheHashes();
+        }
         buffer.seek(len);
     }
 }
@@ -490,81 +1169,361 @@ void TLVNode::encodeTLVNode(TLVS *tlvs, WriteBuffer &buffer) {
     // - has value: encode tag and length, write value
     // - zero length: encode tag and zero length
 
+    //  - unchanged since decode: copy the original encoding
+
+    if (encoded != NULL) {
+        buffer.putBytes(encoded, getTotalBytes());
+        return;
+    }
+
     // Encode Tag and length
     int error = encodeTag(tag, buffer);
     if (error) {
         tlvs->markError(error);
     }
-    error = encodeLength(getValueLength(), buffer);
-    if (error) {
-        tlvs->markError(error);
+    error = encodeLength(getValueLength(), buffer);
+    if (error) {
+        tlvs->markError(error);
+    }
+
+    if (firstChild() != NULL) {
+        // Encode child TLVs
+        TLVNode *child;
+        for (child = firstChild(); child != NULL; child = nextChild(child)) {
+            child->encodeTLVNode(tlvs, buffer);
+        }
+    } else {
+        // Encode the value
+        if (value == NULL) {
+            // No value
+        } else if (value_flash) {
+            buffer.putBytes_P(value, value_length);
+        } else {
+            buffer.putBytes(value, value_length);
+        }
+    }
+}
+
+uint16_t TLVNode::getTag() const
+{
+    return tag;
+}
+
+const uint8_t* TLVNode::getValue() const
+{
+    if (child != NULL) {
+        return NULL;
+    }
+    return value;
+}
+ 
+bool TLVNode::valueInFlash() const
+{
+    return value_flash;
+}
+
+//
+// Copy a short value to bytes if it is in flash.
+// Returns NULL if there is no value or it is longer than max_length.
+const uint8_t* TLVNode::shortValue(uint8_t *bytes, uint16_t max_length) const
+{
+    const uint8_t *data = getValue();
+    if (data == NULL || value_length > max_length) {
+        return NULL;
+    }
+    if (value_flash) {
+        memcpy_P(bytes, data, value_length);
+        data = bytes;
+    }
+    return data;
+}
+
+//
+// Load up to 8 bytes as a big endian integer
+static uint64_t loadBigEndian(const uint8_t *data, uint16_t length)
+{
+    uint64_t result = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && !defined(__AVR__)
+    // Single word load and byte swap
+    uint8_t bytes[8] = { 0 };
+    memcpy(bytes + sizeof(bytes) - length, data, length);
+    memcpy(&result, bytes, sizeof(result));
+    result = __builtin_bswap64(result);
+#else
+    for (uint16_t i = 0; i < length; i++) {
+        result = (result << 8) | data[i];
+    }
+#endif
+    return result;
+}
+
+bool TLVNode::getUInt(uint32_t *result) const
+{
+    uint8_t bytes[4];
+    const uint8_t *data = shortValue(bytes, sizeof(bytes));
+    if (data == NULL) {
+        return false;
+    }
+    *result = (uint32_t) loadBigEndian(data, value_length);
+    return true;
+}
+
+bool TLVNode::getUInt64(uint64_t *result) const
+{
+    uint8_t bytes[8];
+    const uint8_t *data = shortValue(bytes, sizeof(bytes));
+    if (data == NULL) {
+        return false;
+    }
+    *result = loadBigEndian(data, value_length);
+    return true;
+}
+
+//
+// Convert two digits per byte with a table lookup
+bool TLVNode::getBCD(uint64_t *result) const
+{
+    uint8_t bytes[9];
+    const uint8_t *data = shortValue(bytes, sizeof(bytes));
+    if (data == NULL) {
+        return false;
+    }
+
+    uint64_t number = 0;
+    for (uint16_t i = 0; i < value_length; i++) {
+        uint8_t pair = pgm_read_byte(&bcd_values[data[i]]);
+        if (pair == BCD_INVALID) {
+            return false;
+        }
+        number = number * 100 + pair;
+    }
+    *result = number;
+    return true;
+}
+
+bool TLVNode::getDate(uint8_t *year, uint8_t *month, uint8_t *day) const
+{
+    uint8_t bytes[3];
+    const uint8_t *data = shortValue(bytes, sizeof(bytes));
+    if (data == NULL || value_length != 3) {
+        return false;
+    }
+
+    uint8_t yy = pgm_read_byte(&bcd_values[data[0]]);
+    uint8_t mm = pgm_read_byte(&bcd_values[data[1]]);
+    uint8_t dd = pgm_read_byte(&bcd_values[data[2]]);
+    if (yy == BCD_INVALID || mm == 0 || mm > 12 || dd == 0 || dd > 31) {
+        return false;
+    }
+    *year = yy;
+    *month = mm;
+    *day = dd;
+    return true;
+}
+
+size_t TLVNode::getCompressedNumeric(char *digits, size_t digits_size) const
+{
+    uint8_t bytes[16];
+    const uint8_t *data = shortValue(bytes, sizeof(bytes));
+    if (data == NULL || digits_size == 0) {
+        return 0;
+    }
+
+    size_t count = 0;
+    bool padding = false;
+    for (uint16_t i = 0; i < value_length * 2; i++) {
+        uint8_t nibble = (i & 1) ? (data[i / 2] & 0x0f) : (data[i / 2] >> 4);
+        if (nibble == 0x0f) {
+            padding = true;
+        } else if (padding || nibble > 9 || count + 1 >= digits_size) {
+            // Digit after padding, not a digit, or out of space
+            digits[0] = '\0';
+            return 0;
+        } else {
+            digits[count++] = '0' + nibble;
+        }
+    }
+    digits[count] = '\0';
+    return count;
+}
+
+bool TLVNode::testBit(uint16_t byte, uint8_t bit) const
+{
+    const uint8_t *data = getValue();
+    if (data == NULL || byte == 0 || byte > value_length || bit == 0 || bit > 8) {
+        return false;
+    }
+    uint8_t value_byte = value_flash ? pgm_read_byte(data + byte - 1) : data[byte - 1];
+    return value_byte & (1 << (bit - 1));
+}
+
+//
+// Return the length of the data value
+// Calculates the size of the nested TLVs if not cached.
+uint32_t TLVNode::getValueLength() const
+{
+    if (value_length == 0 && child != NULL) {
+        uint32_t length = 0;
+        TLVNode *node;
+        for (node = child; node != NULL; node = node->next) {
+            length += node->getTotalBytes();
+        }
+        return length;
+    } 
+    return value_length;
+}
+
+//
+// Calculate and cache the size of nested TLVs for this TLV and all children.
+// Only writes to nodes without a cached size.
+void TLVNode::cacheSizes()
+{
+    if (child == NULL) {
+        return;
+    }
+
+    uint32_t length = 0;
+    TLVNode *node;
+    for (node = child; node != NULL; node = node->next) {
+        node->cacheSizes();
+        length += node->getTotalBytes();
+    }
+    if (value_length == 0) {
+        value_length = length;
+    }
+}
+
+//
+// Return the original encoding of a decoded TLV
+// NULL if not decoded or modified after decode.
+const uint8_t* TLVNode::getEncoded() const
+{
+    return encoded;
+}
+
+uint32_t TLVNode::getEncodedLength() const
+{
+    if (encoded == NULL) {
+        return 0;
+    }
+    return getTotalBytes();
+}
+
+//
+// Return the total size of the encoded TLV
+uint32_t TLVNode::getTotalBytes() const
+{
+    uint32_t length = getValueLength();
+    if (encoded != NULL) {
+        // Original header may use a longer length form than needed
+        return encoded_header + length;
+    }
+    return Tag::numTagBytes(tag) + Tag::numLengthBytes(length) + length;
+}
+
+//
+// FNV-1a hash, 32 bit
+#define HASH_OFFSET 2166136261UL
+#define HASH_PRIME 16777619UL
+
+static uint32_t hashByte(uint32_t hash, uint8_t byte)
+{
+    return (hash ^ byte) * HASH_PRIME;
+}
+
+static uint32_t hashUInt32(uint32_t hash, uint32_t value)
+{
+    hash = hashByte(hash, (value >> 24) & 0xff);
+    hash = hashByte(hash, (value >> 16) & 0xff);
+    hash = hashByte(hash, (value >> 8) & 0xff);
+    return hashByte(hash, value & 0xff);
+}
+
+//
+// Hash the tag, then the child hashes or the value length and value.
+// Lengths and zero padding of constructed TLVs are left out, as a
+// decoded TLV may include padding.
+// Uses saved hashes where available, doesn't save new ones.
+uint32_t TLVNode::getHash() const
+{
+    if (hash_valid) {
+        return hash_value;
+    }
+
+    uint32_t hash = HASH_OFFSET;
+    hash = hashByte(hash, tag >> 8);
+    hash = hashByte(hash, tag & 0xff);
+
+    if (child != NULL) {
+        for (TLVNode *node = child; node != NULL; node = node->next) {
+            hash = hashUInt32(hash, node->getHash());
+        }
+        return hash;
+    }
+    if (Tag::tagConstructed(tag) && onlyPadding()) {
+        // Same as a constructed TLV without child TLVs
+        return hash;
     }
 
-    if (firstChild() != NULL) {
-        // Encode child TLVs
-        TLVNode *child;
-        for (child = firstChild(); child != NULL; child = nextChild(child)) {
-            child->encodeTLVNode(tlvs, buffer);
+    hash = hashUInt32(hash, value_length);
+    if (value == NULL) {
+        // No value
+    } else if (value_flash) {
+        for (uint16_t i = 0; i < value_length; i++) {
+            hash = hashByte(hash, pgm_read_byte(&value[i]));
         }
     } else {
-        // Encode the value
         for (uint16_t i = 0; i < value_length; i++) {
-            buffer.putByte(value[i]);
+            hash = hashByte(hash, value[i]);
         }
     }
+    return hash;
 }
 
-uint16_t TLVNode::getTag()
-{
-    return tag;
-}
-
-const uint8_t* TLVNode::getValue()
-{
-    if (child != NULL) {
-        return NULL;
-    }
-    return value;
-}
- 
 //
-// Return the length of the data value
-// May calculate and cache the size of the nested TLVs
-uint32_t TLVNode::getValueLength()
+// True if the value is empty or all zero padding
+bool TLVNode::onlyPadding() const
 {
-    if (value_length == 0 && child != NULL) {
-        // Calculate and cachle the size of child TLVs
-        TLVNode *node;
-        for (node = child; node != NULL; node = node->next) {
-            value_length += node->getTotalBytes();
+    for (uint16_t i = 0; i < value_length && value != NULL; i++) {
+        uint8_t byte = value_flash ? pgm_read_byte(&value[i]) : value[i];
+        if (byte != 0) {
+            return false;
         }
-    } 
-    return value_length;
+    }
+    return true;
 }
 
 //
-// Return the total size of the encoded TLV
-uint32_t TLVNode::getTotalBytes()
+// Calculate and save the hash for this TLV and all children.
+// Only writes to nodes without a saved hash.
+void TLVNode::cacheHashes()
 {
-    return Tag::numTagBytes(tag) + Tag::numLengthBytes(getValueLength()) + getValueLength();
+    if (hash_valid) {
+        return;
+    }
+    for (TLVNode *node = child; node != NULL; node = node->next) {
+        node->cacheHashes();
+    }
+    hash_value = getHash();
+    hash_valid = true;
 }
 
  
 //
 // Returns NULL if no child TLVs
-TLVNode* TLVNode::firstChild()
+TLVNode* TLVNode::firstChild() const
 {
     return child;
 }
 
 //
 // Returns NULL if no more child TLVs.
-TLVNode* TLVNode::nextChild(TLVNode* child)
+TLVNode* TLVNode::nextChild(const TLVNode* child) const
 {
     return child->next;
 }
 
-TLVNode* TLVNode::findChild(uint16_t tag)
+TLVNode* TLVNode::findChild(uint16_t tag) const
 {
     TLVNode* node;
     for (node = firstChild(); node != NULL; node = nextChild(node)) {
@@ -581,26 +1540,62 @@ void TLVNode::addChild(TLVNode* node)
 {
     if (child == NULL) {
         child = node;
-        node->parent = this;
-        return;
-    }
-    TLVNode *last_child = child;
-    while (last_child->next != NULL) {
-        last_child = last_child->next;
+    } else {
+        TLVNode *last_child = child;
+        while (last_child->next != NULL) {
+            last_child = last_child->next;
+        }
+        last_child->next = node;
     }
-    last_child->next = node;
     node->parent = this;
 
     // Number of child TLVs changed, ensure no length values are cached
     clearCachedSize();
 }
 
+//
+// Remove a TLV from the list, the TLV is not freed
+void TLVNode::removeChild(TLVNode* node)
+{
+    if (child == node) {
+        child = node->next;
+    } else {
+        TLVNode *prev_child = child;
+        while (prev_child != NULL && prev_child->next != node) {
+            prev_child = prev_child->next;
+        }
+        if (prev_child == NULL) {
+            return;
+        }
+        prev_child->next = node->next;
+    }
+    node->next = NULL;
+    node->parent = NULL;
+
+    // Number of child TLVs changed, ensure no length values are cached
+    clearCachedSize();
+}
+
+//
+// Drop the original or cached encoding
+void TLVNode::clearEncoded()
+{
+    if (encoded_allocated) {
+        free((uint8_t*)encoded);
+        encoded_allocated = false;
+    }
+    encoded = NULL;
+    encoded_header = 0;
+}
+
 // 
 // Called when number of child TLVs have changed
 void TLVNode::clearCachedSize()
 {
-    // Clear any calculated length values
+    // Clear any calculated length values, the saved encoding and hash
     value_length = 0;
+    clearEncoded();
+    hash_valid = false;
     if (parent != NULL) {
         parent->clearCachedSize();
     }
@@ -667,7 +1662,7 @@ ReadBuffer::ReadBuffer()
 }
 
 
-ReadBuffer::ReadBuffer(const uint8_t *buffer, uint16_t size)
+ReadBuffer::ReadBuffer(const uint8_t *buffer, size_t size)
 {
     this->buffer = buffer;
     this->buffer_size = size;
@@ -733,7 +1728,7 @@ WriteBuffer::WriteBuffer()
 }
 
 
-WriteBuffer::WriteBuffer(uint8_t *buffer, uint16_t size)
+WriteBuffer::WriteBuffer(uint8_t *buffer, size_t size)
 {
     this->buffer = buffer;
     this->buffer_size = size;
@@ -758,13 +1753,569 @@ bool WriteBuffer::putByte(uint8_t value)
     return false;
 }
 
-bool WriteBuffer::putBytes(const uint8_t *values, uint8_t len)
+// Write a block of bytes to the buffer
+// Writes as much as fits, return false if out of space.
+bool WriteBuffer::putBytes(const uint8_t *values, size_t len)
+{
+    bool ok = true;
+    if (len > buffer_size - pos) {
+        len = buffer_size - pos;
+        ok = false;
+    }
+    memcpy(buffer + pos, values, len);
+    pos += len;
+    return ok;
+}
+
+// Write a block of bytes from flash to the buffer
+// Writes as much as fits, return false if out of space.
+bool WriteBuffer::putBytes_P(const uint8_t *values, size_t len)
 {
     bool ok = true;
-    for (int i = 0; i < len; i++) {
-        bool result = putByte(values[i]);
-        ok = ok && result;
+    if (len > buffer_size - pos) {
+        len = buffer_size - pos;
+        ok = false;
     }
+    memcpy_P(buffer + pos, values, len);
+    pos += len;
     return ok;
 }
 
+
+
+//
+// TLVFilter: stream TLVs from input to output applying rules by tag
+//
+
+TLVFilter::TLVFilter(const TLVRule *rules, size_t rule_count)
+{
+    this->rules = rules;
+    this->rule_count = rule_count;
+    this->error_value = TLVS::ERROR_NONE;
+}
+
+int TLVFilter::errorValue() const
+{
+    return error_value;
+}
+
+void TLVFilter::markError(int error)
+{
+    // Save the first error
+    if (error_value == TLVS::ERROR_NONE) {
+        error_value = error;
+    }
+}
+
+size_t TLVFilter::transform(ReadBuffer &input, WriteBuffer &output)
+{
+    size_t start = output.pos;
+    error_value = TLVS::ERROR_NONE;
+    transformHelper(input, output, 1);
+    return output.pos - start;
+}
+
+const TLVRule* TLVFilter::findRule(uint16_t tag) const
+{
+    for (size_t i = 0; i < rule_count; i++) {
+        if (rules[i].tag == tag) {
+            return &rules[i];
+        }
+    }
+    return NULL;
+}
+
+//
+// Write a tag and length, checking there is space for the value.
+bool TLVFilter::putHeader(uint16_t tag, uint16_t length, WriteBuffer &output)
+{
+    size_t size = Tag::numTagBytes(tag) + Tag::numLengthBytes(length) + length;
+    if (size > output.buffer_size - output.pos) {
+        markError(TLVS::ERROR_BUFFER_SIZE);
+        return false;
+    }
+    int error = TLVNode::encodeTag(tag, output);
+    if (error) {
+        markError(error);
+    }
+    TLVNode::encodeLength(length, output);
+    return true;
+}
+
+//
+// Transform the TLVs at one level of nesting.
+// Returns false on the first error.
+bool TLVFilter::transformHelper(ReadBuffer &input, WriteBuffer &output, uint16_t depth)
+{
+    int error = TLVS::ERROR_NONE;
+    uint16_t tag, len;
+    size_t header_start;
+
+    while (TLVNode::parseHeader(input, &tag, &len, &header_start, &error)) {
+        if (depth > MAX_DEPTH) {
+            // Bound the stack used for nested TLVs
+            markError(TLVS::ERROR_DEPTH);
+            return false;
+        }
+
+        const TLVRule *rule = findRule(tag);
+        uint8_t action = (rule != NULL) ? rule->action : KEEP;
+        uint16_t out_tag = (action == RENAME) ? rule->new_tag : tag;
+
+        if (action == DROP) {
+            // Nothing to write
+        } else if (action == REPLACE) {
+            if (!putHeader(out_tag, rule->value_length, output)) {
+                return false;
+            }
+            output.putBytes(rule->value, rule->value_length);
+        } else if (Tag::tagConstructed(tag)) {
+            // Length is not known until the children are written.
+            // Reserve a short form length, and move the children
+            // if a long form length is needed.
+            if (!putHeader(out_tag, 0, output)) {
+                return false;
+            }
+            size_t length_pos = output.pos - 1;
+            ReadBuffer valueBuffer(input, len);
+            if (!transformHelper(valueBuffer, output, depth + 1)) {
+                return false;
+            }
+
+            size_t length = output.pos - (length_pos + 1);
+            if (length > TLVS::MAX_DATA_LENGTH) {
+                markError(TLVS::ERROR_LONG_DATA);
+                return false;
+            }
+            if (length > 127) {
+                if (output.buffer_size - output.pos < 2) {
+                    markError(TLVS::ERROR_BUFFER_SIZE);
+                    return false;
+                }
+                uint8_t *value = output.buffer + length_pos + 1;
+                memmove(value + 2, value, length);
+                output.pos += 2;
+            }
+            WriteBuffer lengthBuffer(output.buffer + length_pos, 3);
+            TLVNode::encodeLength(length, lengthBuffer);
+        } else {
+            if (!putHeader(out_tag, len, output)) {
+                return false;
+            }
+            output.putBytes(input.position(), len);
+        }
+        input.seek(len);
+    }
+    if (error != TLVS::ERROR_NONE) {
+        markError(error);
+        return false;
+    }
+    return true;
+}
+
+//
+// TLVDump: render TLVs as text or JSON to a sink or buffer
+//
+
+TLVDump::TLVDump(Print &sink, int format, size_t max_bytes)
+{
+    this->format = format;
+    this->sink = &sink;
+    this->buffer = chunk;
+    this->buffer_size = sizeof(chunk);
+    this->buffer_pos = 0;
+    this->max_bytes = max_bytes;
+    this->total = 0;
+    this->is_truncated = false;
+    this->tag_names = NULL;
+}
+
+TLVDump::TLVDump(char *buffer, size_t buffer_size, int format)
+{
+    this->format = format;
+    this->sink = NULL;
+    this->buffer = buffer;
+    this->buffer_size = buffer_size;
+    this->buffer_pos = 0;
+    this->total = 0;
+    this->is_truncated = false;
+    this->tag_names = NULL;
+
+    // Leave room for the null
+    if (buffer_size == 0) {
+        this->buffer = NULL;
+        this->max_bytes = 0;
+        this->is_truncated = true;
+    } else {
+        this->max_bytes = buffer_size - 1;
+        buffer[0] = '\0';
+    }
+}
+
+TLVDump::~TLVDump()
+{
+    flush();
+}
+
+bool TLVDump::truncated() const
+{
+    return is_truncated;
+}
+
+void TLVDump::setTagNames(TLVTagName names)
+{
+    tag_names = names;
+}
+
+void TLVDump::flush()
+{
+    if (sink != NULL && buffer_pos > 0) {
+        sink->write((const uint8_t*) buffer, buffer_pos);
+        buffer_pos = 0;
+    }
+}
+
+size_t TLVDump::dump(const TLVS &tlvs)
+{
+    size_t start = total;
+    TLVNode *node = tlvs.firstTLV();
+
+    if (format == FORMAT_JSON) {
+        put("[");
+    }
+    for (; node != NULL && !is_truncated; node = tlvs.nextTLV(node)) {
+        if (format == FORMAT_JSON && node != tlvs.firstTLV()) {
+            put(",");
+        }
+        putNode(node, 0);
+    }
+    if (format == FORMAT_JSON) {
+        put("]");
+    }
+    flush();
+    return total - start;
+}
+
+size_t TLVDump::dump(const TLVNode *node, int indent)
+{
+    size_t start = total;
+    putNode(node, indent);
+    flush();
+    return total - start;
+}
+
+size_t TLVDump::dump(const uint8_t *data, size_t data_size)
+{
+    size_t start = total;
+    uint16_t count = 0;
+    ReadBuffer dataBuffer(data, data_size);
+
+    if (format == FORMAT_JSON) {
+        put("[");
+    }
+    putEncoded(dataBuffer, 0, &count);
+    if (format == FORMAT_JSON) {
+        put("]");
+    }
+    flush();
+    return total - start;
+}
+
+//
+// Add output, respecting the byte limit.
+// Sink output is written when the local buffer fills.
+void TLVDump::put(const char *str, size_t length)
+{
+    if (is_truncated) {
+        return;
+    }
+    if ((max_bytes != 0 || sink == NULL) && total + length > max_bytes) {
+        length = max_bytes - total;
+        is_truncated = true;
+    }
+    total += length;
+
+    if (sink == NULL) {
+        memcpy(buffer + buffer_pos, str, length);
+        buffer_pos += length;
+        buffer[buffer_pos] = '\0';
+        return;
+    }
+
+    while (length > 0) {
+        size_t count = buffer_size - buffer_pos;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(buffer + buffer_pos, str, count);
+        buffer_pos += count;
+        str += count;
+        length -= count;
+        if (buffer_pos == buffer_size) {
+            flush();
+        }
+    }
+}
+
+void TLVDump::put(const char *str)
+{
+    put(str, strlen(str));
+}
+
+//
+// Output the name of a tag, if known. Names are stored in flash.
+void TLVDump::putName(uint16_t tag)
+{
+    const char *name = (tag_names != NULL) ? tag_names(tag) : NULL;
+    if (name == NULL) {
+        return;
+    }
+
+    put(format == FORMAT_JSON ? ",\"name\":\"" : " (");
+    char str[16];
+    size_t length = strlen_P(name);
+    for (size_t i = 0; i < length; i += sizeof(str)) {
+        size_t count = length - i;
+        if (count > sizeof(str)) {
+            count = sizeof(str);
+        }
+        memcpy_P(str, name + i, count);
+        put(str, count);
+    }
+    put(format == FORMAT_JSON ? "\"" : ")");
+}
+
+//
+// Output a value in hex, without leading zeros
+void TLVDump::putHex(uint32_t value)
+{
+    char str[8];
+    size_t pos = sizeof(str);
+    do {
+        str[--pos] = pgm_read_byte(&hex_digits[value & 0xf]);
+        value >>= 4;
+    } while (value != 0);
+    put(str + pos, sizeof(str) - pos);
+}
+
+void TLVDump::putDecimal(uint32_t value)
+{
+    char str[10];
+    size_t pos = sizeof(str);
+    do {
+        str[--pos] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    put(str + pos, sizeof(str) - pos);
+}
+
+void TLVDump::putIndent(int indent)
+{
+    static const char spaces[] = "                ";
+    size_t count = indent * 4;
+    while (count > 0) {
+        size_t length = count < sizeof(spaces) - 1 ? count : sizeof(spaces) - 1;
+        put(spaces, length);
+        count -= length;
+    }
+}
+
+//
+// Output a value as text if printable, otherwise as hex
+// Values in flash are read with pgm_read_byte / memcpy_P.
+void TLVDump::putValue(const uint8_t *data, size_t length, bool flash)
+{
+    if (data == NULL) {
+        return;
+    }
+
+    bool ascii = true;
+    for (size_t i = 0; i < length; i++) {
+        uint8_t byte = flash ? pgm_read_byte(data + i) : data[i];
+        if (byte < 32 || byte > 126) {
+            ascii = false;
+            break;
+        }
+    }
+
+    // Convert in blocks that fit a local buffer
+    char str[16 * 3 + 1];
+    uint8_t bytes[16];
+    for (size_t i = 0; i < length && !is_truncated; i += 16) {
+        size_t count = length - i;
+        if (count > 16) {
+            count = 16;
+        }
+        const uint8_t *block = data + i;
+        if (flash) {
+            memcpy_P(bytes, block, count);
+            block = bytes;
+        }
+
+        size_t str_length = 0;
+        if (format == FORMAT_JSON) {
+            str_length = TLVS::binToHex(block, count, str, sizeof(str));
+        } else if (ascii) {
+            for (size_t j = 0; j < count; j++) {
+                str[str_length++] = (char) block[j];
+                str[str_length++] = ' ';
+            }
+        } else {
+            if (i != 0) {
+                str[str_length++] = ' ';
+            }
+            str_length += TLVS::binToHex(block, count, str + str_length,
+                                         sizeof(str) - str_length, ' ');
+        }
+        put(str, str_length);
+    }
+}
+
+//
+// Output a TLV and child TLVs
+void TLVDump::putNode(const TLVNode *node, int indent)
+{
+    if (format == FORMAT_JSON) {
+        if (node == NULL) {
+            put("null");
+            return;
+        }
+        put("{\"tag\":\"");
+        putHex(node->getTag());
+        put("\"");
+        putName(node->getTag());
+        put(",\"length\":");
+        putDecimal(node->getValueLength());
+        if (Tag::tagConstructed(node->getTag())) {
+            put(",\"tlvs\":[");
+            for (TLVNode *child = node->firstChild(); child != NULL && !is_truncated;
+                 child = node->nextChild(child)) {
+                if (child != node->firstChild()) {
+                    put(",");
+                }
+                putNode(child, indent + 1);
+            }
+            put("]}");
+        } else {
+            put(",\"value\":\"");
+            putValue(node->getValue(), node->getValueLength(), node->valueInFlash());
+            put("\"}");
+        }
+        return;
+    }
+
+    putIndent(indent);
+    if (node == NULL) {
+        put("NULL pointer for TLVNode....\r\n");
+        return;
+    }
+
+    put("Tag: ");
+    putHex(node->getTag());
+    putName(node->getTag());
+    put(" Length: ");
+    putHex(node->getValueLength());
+    put("\r\n");
+
+    TLVNode *child = node->firstChild();
+    if (child == NULL) {
+        putIndent(indent + 1);
+        putValue(node->getValue(), node->getValueLength(), node->valueInFlash());
+        put("\r\n");
+    }
+
+    while (child != NULL && !is_truncated) {
+        putNode(child, indent + 1);
+        child = node->nextChild(child);
+    }
+}
+
+//
+// Output TLVs directly from an encoded buffer.
+// Follows TLVS::validateTLVs, returns false after outputting an error.
+bool TLVDump::putEncoded(ReadBuffer &buffer, int indent, uint16_t *count)
+{
+    int error = TLVS::ERROR_NONE;
+    uint16_t tag, len;
+    size_t header_start;
+
+    while (!is_truncated) {
+        if (!TLVNode::parseHeader(buffer, &tag, &len, &header_start, &error) &&
+            error == TLVS::ERROR_NONE) {
+            // End of the buffer
+            break;
+        }
+
+        if (format == FORMAT_JSON && *count > 0) {
+            put(",");
+        }
+        (*count)++;
+
+        if (error != TLVS::ERROR_NONE) {
+            if (format == FORMAT_JSON) {
+                put("{\"error\":");
+                putDecimal(error);
+                put(",\"offset\":");
+                putDecimal(header_start);
+                put("}");
+            } else {
+                putIndent(indent);
+                put("Error: ");
+                putDecimal(error);
+                put(" Offset: ");
+                putHex(header_start);
+                put("\r\n");
+            }
+            return false;
+        }
+
+        const uint8_t *value = buffer.position();
+        if (format == FORMAT_JSON) {
+            put("{\"tag\":\"");
+            putHex(tag);
+            put("\"");
+            putName(tag);
+            put(",\"length\":");
+            putDecimal(len);
+        } else {
+            putIndent(indent);
+            put("Tag: ");
+            putHex(tag);
+            putName(tag);
+            put(" Length: ");
+            putHex(len);
+            put("\r\n");
+        }
+
+        bool ok = true;
+        uint16_t child_count = 0;
+        if (Tag::tagConstructed(tag)) {
+            if (format == FORMAT_JSON) {
+                put(",\"tlvs\":[");
+            }
+            ReadBuffer valueBuffer(buffer, len);
+            ok = putEncoded(valueBuffer, indent + 1, &child_count);
+            if (format == FORMAT_JSON) {
+                put("]");
+            }
+        } else if (format == FORMAT_JSON) {
+            put(",\"value\":\"");
+            putValue(value, len);
+            put("\"");
+        }
+
+        if (format == FORMAT_JSON) {
+            put("}");
+        } else if (child_count == 0) {
+            putIndent(indent + 1);
+            putValue(value, len);
+            put("\r\n");
+        }
+
+        if (!ok) {
+            return false;
+        }
+        buffer.seek(len);
+    }
+    return true;
+}
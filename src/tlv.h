@@ -23,10 +23,25 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// Deepest TLV nesting TLVFilter will transform
+#ifndef TLV_MAX_DEPTH
+#define TLV_MAX_DEPTH 16
+#endif
+
 
 class TLVS;
+class TLVNode;
 class ReadBuffer;
 class WriteBuffer;
+class Print;
+
+// Returns the name of a tag stored in flash (PROGMEM), or NULL.
+// See TLVTags::name in tlvtags.h
+typedef const char* (*TLVTagName)(uint16_t tag);
+
+// Called for each difference found by TLVS::diffTLVs.
+// a or b is NULL if the TLV is only in one of the TLVS.
+typedef void (*TLVDiffCallback)(const TLVNode *a, const TLVNode *b, void *context);
 
 
 //
@@ -37,14 +52,59 @@ class WriteBuffer;
 class TLVNode {
 public:
     // Access tag and value
-    uint16_t getTag();
-    uint32_t getValueLength();
-    const uint8_t* getValue();
+    uint16_t getTag() const;
+    uint32_t getValueLength() const;
+    const uint8_t* getValue() const;
+
+    // True if the value is stored in flash (PROGMEM).
+    // Read with pgm_read_byte / memcpy_P rather than getValue()[i].
+    bool valueInFlash() const;
+
+    // Typed access to the value.
+    // Return false if the value is too long or not valid for the type.
+
+    // Big endian unsigned integer, up to 4 or 8 bytes.
+    bool getUInt(uint32_t *result) const;
+    bool getUInt64(uint64_t *result) const;
+
+    // Packed BCD (EMV format n), up to 9 bytes / 18 digits.
+    bool getBCD(uint64_t *result) const;
+
+    // Date in packed BCD YYMMDD form (EMV format n 6).
+    bool getDate(uint8_t *year, uint8_t *month, uint8_t *day) const;
+
+    // Compressed numeric (EMV format cn), digits padded on the right with F.
+    // Writes the digits as a null terminated string.
+    // Returns the number of digits, 0 if not valid or digits is too small.
+    size_t getCompressedNumeric(char *digits, size_t digits_size) const;
+
+    // Test a bit in the value, numbered as in EMV specifications:
+    // byte 1 is the first byte, bit 8 is the high bit and bit 1 the low bit.
+    // False if the byte is past the end of the value.
+    bool testBit(uint16_t byte, uint8_t bit) const;
 
     // Access child TLVs
-    TLVNode* firstChild();
-    TLVNode* nextChild(TLVNode* child);
-    TLVNode* findChild(uint16_t tag);
+    TLVNode* firstChild() const;
+    TLVNode* nextChild(const TLVNode* child) const;
+    TLVNode* findChild(uint16_t tag) const;
+
+    // Original encoding (tag, length and value) of a decoded TLV, or the
+    // encoding saved by TLVS::cacheTLV.
+    // Enables forwarding a TLV and children without re-encoding.
+    // NULL / 0 if the TLV was added and not cached, or a child TLV has
+    // changed since decode or caching.
+    const uint8_t* getEncoded() const;
+    uint32_t getEncodedLength() const;
+
+    // Exact size of the TLV and children once encoded
+    uint32_t getTotalBytes() const;
+
+    // Hash of the tag and value, or the tag and the hashes of child TLVs.
+    // TLVs with the same contents have the same hash, whether decoded or added.
+    // Zero padding and long length forms in decoded constructed TLVs,
+    // including a TLV holding only padding, are not included.
+    // Calculated on each call unless saved, see TLVS::cacheHashes.
+    uint32_t getHash() const;
     
     // Utility functions to encode decode tags and length
     // Public to enable testing.
@@ -53,16 +113,32 @@ public:
     static uint16_t parseLength(ReadBuffer &buffer, int *error);
     static int encodeLength(uint32_t length, WriteBuffer &buffer);
 
+    // Skip zero padding and parse the tag and length of the next TLV.
+    // header_start is set to the offset of the tag.
+    // Returns false at the end of the buffer, or on an error, which
+    // includes ERROR_END_DATA if the value runs past the end of the buffer.
+    static bool parseHeader(ReadBuffer &buffer, uint16_t *tag, uint16_t *length,
+                            size_t *header_start, int *error);
+
 private:
     TLVNode(uint16_t tag = 0, uint16_t length = 0);
     ~TLVNode();
 
+    // Nodes are owned by a TLVS and linked in to a tree, no copies.
+    TLVNode(const TLVNode &) = delete;
+    TLVNode& operator=(const TLVNode &) = delete;
+
     void freeContents();
-    uint32_t getTotalBytes();
+    void cacheSizes();
+    void cacheHashes();
     void encodeTLVNode(TLVS *tlvs, WriteBuffer &buffer);
     void decodeTLVNode(TLVS *tlvs, ReadBuffer &buffer);
     void clearCachedSize();
+    void clearEncoded();
+    const uint8_t* shortValue(uint8_t *bytes, uint16_t max_length) const;
+    bool onlyPadding() const;
     void addChild(TLVNode* node);
+    void removeChild(TLVNode* node);
 
     // value may be NULL
     const uint8_t  *value;
@@ -70,6 +146,13 @@ private:
     // May represent the length of value, or the total length of the child TLVs
     uint16_t value_length;
 
+    // Original encoding of a decoded TLV or a cached encoding, may be NULL.
+    // Points into the decode buffer, like value, or cache storage.
+    const uint8_t *encoded;
+
+    // Number of tag and length bytes at the start of encoded
+    uint8_t encoded_header;
+
     // May have a value or child TLVs, but not both
 
     TLVNode  *parent;       // Parent TLV
@@ -79,12 +162,42 @@ private:
     // True if value was copied and should be freed.
     bool value_allocated;
 
+    // True if value points to flash (PROGMEM)
+    bool value_flash;
+
+    // True if encoded was allocated by cacheTLV and should be freed.
+    bool encoded_allocated;
+
+    // True if hash_value is saved for the current contents
+    bool hash_valid;
+    uint32_t hash_value;
+
     uint16_t tag;       // support 1 or 2 bytes
 
     friend class TLVS;
 };
 
 
+//
+// Results of checking a buffer with TLVS::validateTLVs
+//
+struct TLVInfo {
+    int error;              // First error found, 0 == no error
+    size_t error_offset;    // Buffer offset of the TLV with the error
+    uint32_t node_count;    // Number of TLVs, including nested TLVs
+    uint16_t max_depth;     // Deepest nesting, 1 == only top level TLVs
+};
+
+
+//
+// View of one record in a batch buffer, see TLVS::decodeBatch
+//
+struct TLVRecord {
+    const uint8_t *data;
+    size_t length;
+};
+
+
 //
 // List of TLV values.
 // Supports encode / decode. Adding TLVs
@@ -93,24 +206,90 @@ class TLVS {
 public:
     TLVS();
 
+    // Take the TLVs from another TLVS, which is left empty.
+    // No nodes or values are copied.
+    TLVS(TLVS &&other);
+    TLVS& operator=(TLVS &&other);
+
+    // A TLVS owns its nodes, copying is not supported.
+    TLVS(const TLVS &) = delete;
+    TLVS& operator=(const TLVS &) = delete;
+
     // Free any allocates values and ready for re-use.
     void reset();
 
     // Encode TLV Nodes into the buffer.
-    size_t encodeTLVs(uint8_t *buffer, size_t buffer_size);
+    // If the buffer is too small, writes nothing, returns 0 and
+    // reports ERROR_BUFFER_SIZE. Optionally returns the size needed.
+    // encodeTLVs(NULL, 0, &size) queries the size without an error.
+    size_t encodeTLVs(uint8_t *buffer, size_t buffer_size, size_t *required_size = NULL);
+
+    // Exact size of all TLVs once encoded
+    size_t encodedSize();
 
     // Decode buffer contents and create TLV nodes
     void decodeTLVs(const uint8_t *buffer, size_t buffer_size);
+
+    // Batch framing
+    static const int FRAME_NONE = 0;        // Records back to back
+    static const int FRAME_LENGTH = 1;      // 2 byte big endian length before each record
+
+    // Encode count TLVS from an array back to back into one buffer.
+    // Returns the number of bytes written. Stops before a record that does
+    // not fit and reports ERROR_BUFFER_SIZE. error may be NULL.
+    static size_t encodeBatch(TLVS *batch, size_t count, uint8_t *buffer, size_t buffer_size,
+                              int framing, int *error);
+
+    // Split a batch buffer into records without decoding or allocating.
+    // With FRAME_NONE, each top level TLV is a record.
+    // Decode a record with decodeTLVs(record.data, record.length).
+    // Returns the number of records, at most max_records.
+    // Reports ERROR_BUFFER_SIZE if there are more records. error may be NULL.
+    static size_t decodeBatch(const uint8_t *buffer, size_t buffer_size, int framing,
+                              TLVRecord *records, size_t max_records, int *error);
+
+    // Check buffer contents without creating TLV nodes or allocating memory.
+    // Returns the first error decodeTLVs would report, 0 == no error.
+    // Optionally fill in info with the error offset, TLV count and depth.
+    static int validateTLVs(const uint8_t *buffer, size_t buffer_size, TLVInfo *info = NULL);
     
     // Report first error, if any, from an encode or decode.
     // 0 == no error.
-    int errorValue();
+    int errorValue() const;
 
     // Access TLVs
-    TLVNode* firstTLV();
-    TLVNode* nextTLV(TLVNode* tlvNode);
-    TLVNode* findTLV(uint16_t tag);
-    TLVNode* findNextTLV(TLVNode* node);
+    TLVNode* firstTLV() const;
+    TLVNode* nextTLV(const TLVNode* tlvNode) const;
+    TLVNode* findTLV(uint16_t tag) const;
+    TLVNode* findNextTLV(const TLVNode* node) const;
+
+    // Calculate all cached lengths and block changes to the TLVs.
+    // While frozen, the read and find functions do not modify the TLVS
+    // or TLV nodes and can be called from multiple threads without locks.
+    // Adding, moving or decoding TLVs reports ERROR_FROZEN.
+    void freeze();
+
+    // Allow changes again. reset() also ends the frozen state.
+    void thaw();
+    bool isFrozen() const;
+
+    // Calculate and save the hash of each TLV, making getHash and
+    // diffTLVs a compare of saved values. Adding or moving TLVs clears
+    // the saved hash of the enclosing TLVs.
+    void cacheHashes();
+
+    // Save TLV hashes as TLVs are decoded and when frozen.
+    void setHashing(bool enable);
+
+    // Hash of all TLVs, equal for TLVS with the same contents.
+    uint32_t getHash() const;
+
+    // Compare two TLVS, skipping TLVs with the same hash.
+    // Matching constructed TLVs are compared child by child.
+    // Calls callback, if not NULL, for each TLV that differs.
+    // Returns the number of differences, 0 == same contents.
+    static size_t diffTLVs(const TLVS &a, const TLVS &b,
+                           TLVDiffCallback callback = NULL, void *context = NULL);
 
     // *********  Add new TLVs
 
@@ -132,6 +311,40 @@ public:
     // Add a child / nexted TLV with a binary value. Allocate memory and copy the value.
     TLVNode* addTLVCopy(TLVNode* parent, uint16_t tag, const uint8_t *value, uint16_t value_length);
 
+    // Add a TLV with a binary value stored in flash (PROGMEM).
+    // The value is read from flash when encoding or dumping, no RAM copy.
+    TLVNode* addTLV_P(uint16_t tag, const uint8_t *value, uint16_t value_length);
+
+    // Add a child / nested TLV with a binary value stored in flash (PROGMEM).
+    TLVNode* addTLV_P(TLVNode* parent, uint16_t tag, const uint8_t *value, uint16_t value_length);
+
+    // Add TLVs with typed values. The value is encoded into allocated memory.
+    // parent may be NULL for a top level TLV.
+    // Return NULL if the value does not fit in length bytes.
+
+    // Big endian unsigned integer in length bytes (1 - 8).
+    TLVNode* addTLVUInt(TLVNode* parent, uint16_t tag, uint64_t value, uint8_t length);
+
+    // Packed BCD (EMV format n) in length bytes (1 - 9), leading zeros.
+    TLVNode* addTLVBCD(TLVNode* parent, uint16_t tag, uint64_t value, uint8_t length);
+
+    // Compressed numeric (EMV format cn) in length bytes, padded with F.
+    TLVNode* addTLVCompressedNumeric(TLVNode* parent, uint16_t tag, const char *digits, uint8_t length);
+
+    // Encode a TLV and its children once and save the result.
+    // Later encodes copy the saved bytes rather than walking the TLVs.
+    // Adding or moving TLVs under the node through this TLVS drops the cache.
+    // Saves to storage if provided, otherwise allocates memory.
+    // Returns false if storage is too small, memory is not available,
+    // or the encode reports an error.
+    bool cacheTLV(TLVNode* node, uint8_t *storage = NULL, size_t storage_size = 0);
+
+    // Move a TLV and its children from source (may be this TLVS)
+    // Added as a child of parent, or as a top level TLV if parent is NULL.
+    // Nodes and values are re-linked, not copied.
+    // Returns NULL if node is not in source or parent is not in this TLVS.
+    TLVNode* moveTLV(TLVS &source, TLVNode* node, TLVNode* parent = NULL);
+
 
     // Utility functions
 
@@ -139,12 +352,26 @@ public:
     static void printHex(const uint8_t *data, size_t length);
     static void printValue(const uint8_t *data, size_t length);
 
-    // Print a TLV to stdout
-    static void printTLV(TLVNode* node, int indent=0);
+    // Print a TLV to stdout, optionally with tag names
+    // See TLVDump for other formats and outputs.
+    static void printTLV(const TLVNode* node, int indent=0, TLVTagName names=NULL);
 
     // Parse a hex string to a binary buffer
     static size_t hexToBin(const char* str, uint8_t* buffer, size_t buffer_size);
 
+    // Parse str_length hex characters to a binary buffer.
+    // White space is allowed between bytes. Returns the number of bytes written.
+    // Stops and reports ERROR_BAD_HEX or ERROR_BUFFER_SIZE. error may be NULL.
+    static size_t hexToBin(const char* str, size_t str_length,
+                           uint8_t* buffer, size_t buffer_size, int *error);
+
+    // Format a binary buffer as a null terminated hex string.
+    // Bytes are separated by separator, unless it is 0.
+    // Returns the string length. Writes the bytes that fit and reports
+    // ERROR_BUFFER_SIZE if str is too small. error may be NULL.
+    static size_t binToHex(const uint8_t *data, size_t length,
+                           char *str, size_t str_size, char separator = 0, int *error = NULL);
+
     // Maximum size of a TLV
     static const int MAX_DATA_LENGTH = 0xffff;
 
@@ -155,16 +382,164 @@ public:
     static const int ERROR_BAD_LENGTH = 3;
     static const int ERROR_PRIMIVE_TYPE = 4;
     static const int ERROR_END_DATA = 5;
+    static const int ERROR_FROZEN = 6;
+    static const int ERROR_BAD_HEX = 7;
+    static const int ERROR_BUFFER_SIZE = 8;
+    static const int ERROR_TAG_FORMAT = 9;
+    static const int ERROR_DEPTH = 10;
 
 private:
     void markError(int error);
-    TLVNode* findTLVHelper(TLVNode* node, uint16_t tag);
+    void takeContents(TLVS &other);
+    static TLVNode* findTLVHelper(const TLVNode* node, uint16_t tag);
+    static TLVNode* nextInTree(const TLVNode* node);
+    static bool validateHelper(ReadBuffer &buffer, uint16_t depth, TLVInfo *info);
+    static size_t diffHelper(const TLVNode *a, const TLVNode *b,
+                             TLVDiffCallback callback, void *context);
+    static const TLVNode* findSibling(const TLVNode *node, uint16_t tag);
     
     TLVNode dummy_node;     // Child TLVs are the list of TLVs
     int error_value;        // Encode / decode error, if any.
+    bool frozen;            // True if changes are blocked
+    bool hashing;           // True if hashes are saved on decode and freeze
     friend class TLVNode;
+    friend class TLVDump;
 };
 
+
+//
+// Render TLVs as indented text or compact JSON.
+// Output is collected in a local buffer and written to a Print
+// sink (e.g. Serial) in large blocks, or written to a caller's buffer.
+//
+//  TLVDump dump(Serial);
+//  dump.dump(tlvs);
+//
+//  char text[200];
+//  TLVDump dump(text, sizeof(text), TLVDump::FORMAT_JSON);
+//  dump.dump(buffer, buffer_size);
+//
+class TLVDump {
+public:
+    static const int FORMAT_TEXT = 0;
+    static const int FORMAT_JSON = 1;
+
+    // Write to a sink. Stop after max_bytes if not 0.
+    TLVDump(Print &sink, int format = FORMAT_TEXT, size_t max_bytes = 0);
+
+    // Write a null terminated string to buffer.
+    TLVDump(char *buffer, size_t buffer_size, int format = FORMAT_TEXT);
+
+    ~TLVDump();
+
+    // Output for a sink is collected in chunk, no copies.
+    TLVDump(const TLVDump &) = delete;
+    TLVDump& operator=(const TLVDump &) = delete;
+
+    // Dump all TLVs.
+    // Returns the number of bytes output by this call.
+    size_t dump(const TLVS &tlvs);
+
+    // Dump a TLV and children, indented by indent levels for text.
+    size_t dump(const TLVNode *node, int indent = 0);
+
+    // Dump encoded TLVs directly from a buffer, without creating TLV nodes.
+    // Stops and outputs the error and offset of any bad TLV.
+    size_t dump(const uint8_t *buffer, size_t buffer_size);
+
+    // True if output was cut short by max_bytes or the buffer size.
+    bool truncated() const;
+
+    // Include tag names in the output, e.g. TLVTags::name
+    void setTagNames(TLVTagName names);
+
+    // Write buffered output to the sink.
+    void flush();
+
+private:
+    void put(const char *str, size_t length);
+    void put(const char *str);
+    void putName(uint16_t tag);
+    void putHex(uint32_t value);
+    void putDecimal(uint32_t value);
+    void putIndent(int indent);
+    void putValue(const uint8_t *data, size_t length, bool flash = false);
+    void putNode(const TLVNode *node, int indent);
+    bool putEncoded(ReadBuffer &buffer, int indent, uint16_t *count);
+
+    int format;
+    Print *sink;            // NULL if writing to a buffer
+    char *buffer;           // Output for a sink is collected here
+    size_t buffer_size;
+    size_t buffer_pos;
+    size_t max_bytes;       // Output limit, 0 == none
+    size_t total;           // Bytes output so far
+    bool is_truncated;
+    TLVTagName tag_names;   // May be NULL
+    char chunk[64];         // Local buffer for sink output
+
+    friend class TLVS;
+};
+
+//
+// Rule for TLVFilter, applied to TLVs with a matching tag.
+//
+struct TLVRule {
+    uint16_t tag;
+    uint8_t action;             // TLVFilter::KEEP, DROP, RENAME or REPLACE
+    uint16_t new_tag;           // Tag for RENAME
+    const uint8_t *value;       // Value for REPLACE
+    uint16_t value_length;
+};
+
+
+//
+// Copy encoded TLVs from a ReadBuffer to a WriteBuffer in one pass,
+// dropping, renaming or replacing TLVs by tag. Lengths of enclosing
+// TLVs are fixed as the output is written. No TLV nodes are created.
+// Tags without a rule are kept. Zero padding is not copied.
+// TLVs nested deeper than TLV_MAX_DEPTH report ERROR_DEPTH.
+//
+//  TLVRule rules[] = {
+//      { 0x5a, TLVFilter::DROP, 0, NULL, 0 },
+//      { 0x9f10, TLVFilter::RENAME, 0x9f11, NULL, 0 },
+//  };
+//  TLVFilter filter(rules, 2);
+//  size_t size = filter.transform(input, output);
+//
+class TLVFilter {
+public:
+    static const uint8_t KEEP = 0;
+    static const uint8_t DROP = 1;
+    static const uint8_t RENAME = 2;
+    static const uint8_t REPLACE = 3;   // Replace the value, or all child TLVs
+
+    // Maximum nesting of TLVs, 1 == only top level TLVs.
+    // Bounds the stack used by transform.
+    static const int MAX_DEPTH = TLV_MAX_DEPTH;
+
+    TLVFilter(const TLVRule *rules, size_t rule_count);
+
+    // Transform the TLVs in input, writing to output.
+    // Returns the number of bytes written.
+    size_t transform(ReadBuffer &input, WriteBuffer &output);
+
+    // Report first error, if any, from the last transform.
+    // ERROR_BUFFER_SIZE if output ran out of space.
+    int errorValue() const;
+
+private:
+    const TLVRule* findRule(uint16_t tag) const;
+    bool transformHelper(ReadBuffer &input, WriteBuffer &output, uint16_t depth);
+    bool putHeader(uint16_t tag, uint16_t length, WriteBuffer &output);
+    void markError(int error);
+
+    const TLVRule *rules;
+    size_t rule_count;
+    int error_value;
+};
+
+
 // Utility functions to work with tags and length values
 class Tag {
 public:
@@ -181,7 +556,7 @@ public:
 class ReadBuffer {
 public:
     ReadBuffer();
-    ReadBuffer(const uint8_t *buffer, uint16_t size);
+    ReadBuffer(const uint8_t *buffer, size_t size);
 
     // Point to a sub-portion of an existing buffer.
     ReadBuffer(ReadBuffer buffer, uint16_t size);
@@ -213,13 +588,16 @@ public:
 class WriteBuffer {
 public:
     WriteBuffer();
-    WriteBuffer(uint8_t *buffer, uint16_t size);
+    WriteBuffer(uint8_t *buffer, size_t size);
 
     // Write a byte into the buffer. Return false if out of space
     bool putByte(uint8_t value);
 
     // Write multiple into the buffer. Return false if out of space
-    bool putBytes(const uint8_t *values, uint8_t len);
+    bool putBytes(const uint8_t *values, size_t len);
+
+    // Write multiple from flash (PROGMEM). Return false if out of space
+    bool putBytes_P(const uint8_t *values, size_t len);
     
     // Return a pointer to the current write position
     uint8_t *position();
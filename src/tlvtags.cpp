@@ -0,0 +1,312 @@
+//
+// tlvtags.cpp - Dictionary of EMV / ISO 7816 tags
+//
+// Copyright (c) 2025 James Wanderer
+//
+// See tlvtags.h for basic information.
+//
+#include <Arduino.h>
+
+#include "tlvtags.h"
+
+//
+// Tag, name, format, minimum and maximum value length.
+// Based on EMV Book 3 Annex A.
+//
+#define TLV_TAG_LIST(X) \
+    X(0x42, "Issuer Identification Number", N, 3, 3)                \
+    X(0x4F, "Application Identifier (AID)", B, 5, 16)               \
+    X(0x50, "Application Label", ANS, 1, 16)                        \
+    X(0x57, "Track 2 Equivalent Data", B, 0, 19)                    \
+    X(0x5A, "Application PAN", CN, 0, 10)                           \
+    X(0x5F20, "Cardholder Name", ANS, 2, 26)                        \
+    X(0x5F24, "Application Expiration Date", N, 3, 3)               \
+    X(0x5F25, "Application Effective Date", N, 3, 3)                \
+    X(0x5F28, "Issuer Country Code", N, 2, 2)                       \
+    X(0x5F2A, "Transaction Currency Code", N, 2, 2)                 \
+    X(0x5F2D, "Language Preference", AN, 2, 8)                      \
+    X(0x5F30, "Service Code", N, 2, 2)                              \
+    X(0x5F34, "PAN Sequence Number", N, 1, 1)                       \
+    X(0x5F36, "Transaction Currency Exponent", N, 1, 1)             \
+    X(0x5F50, "Issuer URL", ANS, 0, 255)                            \
+    X(0x5F53, "IBAN", B, 0, 34)                                     \
+    X(0x5F54, "Bank Identifier Code (BIC)", B, 8, 11)               \
+    X(0x5F55, "Issuer Country Code (alpha2)", AN, 2, 2)             \
+    X(0x5F56, "Issuer Country Code (alpha3)", AN, 3, 3)             \
+    X(0x61, "Application Template", TEMPLATE, 0, 252)               \
+    X(0x6F, "FCI Template", TEMPLATE, 0, 252)                       \
+    X(0x70, "Record Template", TEMPLATE, 0, 252)                    \
+    X(0x71, "Issuer Script Template 1", TEMPLATE, 0, 252)           \
+    X(0x72, "Issuer Script Template 2", TEMPLATE, 0, 252)           \
+    X(0x73, "Directory Discretionary Template", TEMPLATE, 0, 252)   \
+    X(0x77, "Response Message Template Format 2", TEMPLATE, 0, 252) \
+    X(0x80, "Response Message Template Format 1", B, 0, 252)        \
+    X(0x81, "Amount, Authorised (Binary)", B, 4, 4)                 \
+    X(0x82, "Application Interchange Profile", B, 2, 2)             \
+    X(0x83, "Command Template", B, 0, 252)                          \
+    X(0x84, "DF Name", B, 5, 16)                                    \
+    X(0x86, "Issuer Script Command", B, 0, 255)                     \
+    X(0x87, "Application Priority Indicator", B, 1, 1)              \
+    X(0x88, "Short File Identifier (SFI)", B, 1, 1)                 \
+    X(0x89, "Authorisation Code", AN, 6, 6)                         \
+    X(0x8A, "Authorisation Response Code", AN, 2, 2)                \
+    X(0x8C, "CDOL1", B, 0, 252)                                     \
+    X(0x8D, "CDOL2", B, 0, 252)                                     \
+    X(0x8E, "CVM List", B, 10, 252)                                 \
+    X(0x8F, "CA Public Key Index", B, 1, 1)                         \
+    X(0x90, "Issuer Public Key Certificate", B, 0, 255)             \
+    X(0x91, "Issuer Authentication Data", B, 8, 16)                 \
+    X(0x92, "Issuer Public Key Remainder", B, 0, 255)               \
+    X(0x93, "Signed Static Application Data", B, 0, 255)            \
+    X(0x94, "Application File Locator (AFL)", B, 4, 252)            \
+    X(0x95, "Terminal Verification Results", B, 5, 5)               \
+    X(0x97, "TDOL", B, 0, 252)                                      \
+    X(0x98, "TC Hash Value", B, 20, 20)                             \
+    X(0x99, "Transaction PIN Data", B, 0, 255)                      \
+    X(0x9A, "Transaction Date", N, 3, 3)                            \
+    X(0x9B, "Transaction Status Information", B, 2, 2)              \
+    X(0x9C, "Transaction Type", N, 1, 1)                            \
+    X(0x9D, "DDF Name", B, 5, 16)                                   \
+    X(0xA5, "FCI Proprietary Template", TEMPLATE, 0, 252)           \
+    X(0x9F01, "Acquirer Identifier", N, 6, 6)                       \
+    X(0x9F02, "Amount, Authorised (Numeric)", N, 6, 6)              \
+    X(0x9F03, "Amount, Other (Numeric)", N, 6, 6)                   \
+    X(0x9F04, "Amount, Other (Binary)", B, 4, 4)                    \
+    X(0x9F05, "Application Discretionary Data", B, 1, 32)           \
+    X(0x9F06, "Application Identifier (Terminal)", B, 5, 16)        \
+    X(0x9F07, "Application Usage Control", B, 2, 2)                 \
+    X(0x9F08, "Application Version Number", B, 2, 2)                \
+    X(0x9F09, "Application Version Number (Terminal)", B, 2, 2)     \
+    X(0x9F0D, "Issuer Action Code - Default", B, 5, 5)              \
+    X(0x9F0E, "Issuer Action Code - Denial", B, 5, 5)               \
+    X(0x9F0F, "Issuer Action Code - Online", B, 5, 5)               \
+    X(0x9F10, "Issuer Application Data", B, 0, 32)                  \
+    X(0x9F11, "Issuer Code Table Index", N, 1, 1)                   \
+    X(0x9F12, "Application Preferred Name", ANS, 1, 16)             \
+    X(0x9F13, "Last Online ATC Register", B, 2, 2)                  \
+    X(0x9F14, "Lower Consecutive Offline Limit", B, 1, 1)           \
+    X(0x9F15, "Merchant Category Code", N, 2, 2)                    \
+    X(0x9F16, "Merchant Identifier", ANS, 15, 15)                   \
+    X(0x9F17, "PIN Try Counter", B, 1, 1)                           \
+    X(0x9F18, "Issuer Script Identifier", B, 4, 4)                  \
+    X(0x9F1A, "Terminal Country Code", N, 2, 2)                     \
+    X(0x9F1B, "Terminal Floor Limit", B, 4, 4)                      \
+    X(0x9F1C, "Terminal Identification", AN, 8, 8)                  \
+    X(0x9F1E, "IFD Serial Number", AN, 8, 8)                        \
+    X(0x9F1F, "Track 1 Discretionary Data", ANS, 0, 255)            \
+    X(0x9F21, "Transaction Time", N, 3, 3)                          \
+    X(0x9F26, "Application Cryptogram", B, 8, 8)                    \
+    X(0x9F27, "Cryptogram Information Data", B, 1, 1)               \
+    X(0x9F32, "Issuer Public Key Exponent", B, 1, 3)                \
+    X(0x9F33, "Terminal Capabilities", B, 3, 3)                     \
+    X(0x9F34, "CVM Results", B, 3, 3)                               \
+    X(0x9F35, "Terminal Type", N, 1, 1)                             \
+    X(0x9F36, "Application Transaction Counter (ATC)", B, 2, 2)     \
+    X(0x9F37, "Unpredictable Number", B, 4, 4)                      \
+    X(0x9F38, "PDOL", B, 0, 252)                                    \
+    X(0x9F39, "POS Entry Mode", N, 1, 1)                            \
+    X(0x9F40, "Additional Terminal Capabilities", B, 5, 5)          \
+    X(0x9F41, "Transaction Sequence Counter", N, 2, 4)              \
+    X(0x9F42, "Application Currency Code", N, 2, 2)                 \
+    X(0x9F44, "Application Currency Exponent", N, 1, 1)             \
+    X(0x9F45, "Data Authentication Code", B, 2, 2)                  \
+    X(0x9F46, "ICC Public Key Certificate", B, 0, 255)              \
+    X(0x9F47, "ICC Public Key Exponent", B, 1, 3)                   \
+    X(0x9F48, "ICC Public Key Remainder", B, 0, 255)                \
+    X(0x9F49, "DDOL", B, 0, 252)                                    \
+    X(0x9F4A, "SDA Tag List", B, 0, 252)                            \
+    X(0x9F4B, "Signed Dynamic Application Data", B, 0, 255)         \
+    X(0x9F4C, "ICC Dynamic Number", B, 2, 8)                        \
+    X(0x9F4D, "Log Entry", B, 2, 2)                                 \
+    X(0x9F4E, "Merchant Name and Location", ANS, 0, 255)            \
+    X(0x9F4F, "Log Format", B, 0, 252)                              \
+    X(0xBF0C, "FCI Issuer Discretionary Data", TEMPLATE, 0, 222)
+
+
+//
+// Perfect hash of the tags.
+//
+// The multiplier was chosen so each tag in the list has a different
+// 8 bit hash. If the list changes, the static_assert below reports a
+// collision and a new multiplier is needed.
+//
+static const uint32_t TAG_HASH_MULT = 0x66fec087;
+static const size_t TAG_SLOTS = 256;
+
+static constexpr uint8_t tagHash(uint16_t tag)
+{
+    return (uint8_t)(((uint32_t) tag * TAG_HASH_MULT) >> 24);
+}
+
+// Tags used to build the hash at compile time, not stored
+#define TAG_VALUE(tag, name, format, min_length, max_length) tag,
+static constexpr uint16_t tag_list[] = { TLV_TAG_LIST(TAG_VALUE) };
+static const size_t TAG_COUNT = sizeof(tag_list) / sizeof(tag_list[0]);
+
+// True if no tag after i has the same hash as tag i
+static constexpr bool hashUnique(size_t i, size_t j)
+{
+    return j == TAG_COUNT ? true :
+           tagHash(tag_list[i]) != tagHash(tag_list[j]) && hashUnique(i, j + 1);
+}
+
+static constexpr bool perfectHash(size_t i)
+{
+    return i == TAG_COUNT ? true : hashUnique(i, i + 1) && perfectHash(i + 1);
+}
+
+static_assert(TAG_COUNT < TAG_SLOTS, "Too many tags for the hash table");
+static_assert(perfectHash(0), "Tag hash collision, choose a new TAG_HASH_MULT");
+
+// Index + 1 of the tag with the hash value slot, 0 if none
+static constexpr uint8_t slotEntry(size_t slot, size_t i)
+{
+    return i == TAG_COUNT ? 0 :
+           tagHash(tag_list[i]) == slot ? i + 1 : slotEntry(slot, i + 1);
+}
+
+// Hash slot to tag table, generated at compile time
+#define SLOTS4(i)   slotEntry(i, 0), slotEntry(i + 1, 0), slotEntry(i + 2, 0), slotEntry(i + 3, 0)
+#define SLOTS16(i)  SLOTS4(i), SLOTS4(i + 4), SLOTS4(i + 8), SLOTS4(i + 12)
+#define SLOTS64(i)  SLOTS16(i), SLOTS16(i + 16), SLOTS16(i + 32), SLOTS16(i + 48)
+static const uint8_t tag_slots[TAG_SLOTS] PROGMEM = {
+    SLOTS64(0), SLOTS64(64), SLOTS64(128), SLOTS64(192)
+};
+
+// Tag names and table, in flash
+#define TAG_NAME(tag, name, format, min_length, max_length) \
+    static const char tag_name_##tag[] PROGMEM = name;
+TLV_TAG_LIST(TAG_NAME)
+
+#define TAG_INFO(tag, name, format, min_length, max_length) \
+    { tag, TLVTags::FORMAT_##format, min_length, max_length, tag_name_##tag },
+static const TLVTagInfo tag_table[] PROGMEM = {
+    TLV_TAG_LIST(TAG_INFO)
+};
+
+
+//
+// Lookup with a single hash table probe
+bool TLVTags::find(uint16_t tag, TLVTagInfo *info)
+{
+    uint8_t entry = pgm_read_byte(&tag_slots[tagHash(tag)]);
+    if (entry == 0) {
+        return false;
+    }
+    memcpy_P(info, &tag_table[entry - 1], sizeof(TLVTagInfo));
+    return info->tag == tag;
+}
+
+const char* TLVTags::name(uint16_t tag)
+{
+    TLVTagInfo info;
+    if (!find(tag, &info)) {
+        return NULL;
+    }
+    return info.name;
+}
+
+//
+// Check value characters are valid for the format
+static bool checkFormat(uint8_t format, const uint8_t *value, uint16_t length, bool flash)
+{
+    bool padding = false;
+    for (uint16_t i = 0; i < length; i++) {
+        uint8_t byte = flash ? pgm_read_byte(value + i) : value[i];
+        uint8_t high = byte >> 4;
+        uint8_t low = byte & 0x0f;
+
+        switch (format) {
+        case TLVTags::FORMAT_N:
+            if (high > 9 || low > 9) {
+                return false;
+            }
+            break;
+        case TLVTags::FORMAT_CN:
+            // Digits, then F padding
+            if (padding && byte != 0xff) {
+                return false;
+            }
+            if (high == 0x0f) {
+                padding = true;
+                if (low != 0x0f) {
+                    return false;
+                }
+            } else if (high > 9 || (low > 9 && low != 0x0f)) {
+                return false;
+            } else if (low == 0x0f) {
+                padding = true;
+            }
+            break;
+        case TLVTags::FORMAT_AN:
+            if (!((byte >= '0' && byte <= '9') || (byte >= 'A' && byte <= 'Z') ||
+                  (byte >= 'a' && byte <= 'z'))) {
+                return false;
+            }
+            break;
+        case TLVTags::FORMAT_ANS:
+            if (byte < 0x20 || byte > 0x7e) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+int TLVTags::checkTLV(const TLVNode *node)
+{
+    TLVTagInfo info;
+    if (node == NULL || !find(node->getTag(), &info)) {
+        return TLVS::ERROR_NONE;
+    }
+
+    uint32_t length = node->getValueLength();
+    if (length < info.min_length || length > info.max_length) {
+        return TLVS::ERROR_TAG_FORMAT;
+    }
+    if (info.format == FORMAT_TEMPLATE) {
+        if (!Tag::tagConstructed(node->getTag())) {
+            return TLVS::ERROR_TAG_FORMAT;
+        }
+        return TLVS::ERROR_NONE;
+    }
+    if (node->getValue() != NULL &&
+        !checkFormat(info.format, node->getValue(), length, node->valueInFlash())) {
+        return TLVS::ERROR_TAG_FORMAT;
+    }
+    return TLVS::ERROR_NONE;
+}
+
+int TLVTags::checkTLVs(const TLVS &tlvs, const TLVNode **bad_node)
+{
+    for (TLVNode *node = tlvs.firstTLV(); node != NULL; node = tlvs.nextTLV(node)) {
+        int error = checkHelper(node, bad_node);
+        if (error != TLVS::ERROR_NONE) {
+            return error;
+        }
+    }
+    return TLVS::ERROR_NONE;
+}
+
+//
+// Check a TLV and children
+int TLVTags::checkHelper(const TLVNode *node, const TLVNode **bad_node)
+{
+    int error = checkTLV(node);
+    if (error != TLVS::ERROR_NONE) {
+        if (bad_node != NULL) {
+            *bad_node = node;
+        }
+        return error;
+    }
+    for (TLVNode *child = node->firstChild(); child != NULL; child = node->nextChild(child)) {
+        error = checkHelper(child, bad_node);
+        if (error != TLVS::ERROR_NONE) {
+            return error;
+        }
+    }
+    return TLVS::ERROR_NONE;
+}
@@ -0,0 +1,66 @@
+//
+// tlvtags.h - Dictionary of EMV / ISO 7816 tags
+//
+// Copyright (c) 2025 James Wanderer
+//
+// Maps tags to a name, expected value format and length limits.
+// Lookups use a perfect hash built at compile time, and the
+// dictionary is stored in flash (PROGMEM).
+//
+//  Print TLVs with tag names:
+//  TLVS::printTLV(tlvs.firstTLV(), 0, TLVTags::name);
+//
+//  Check TLVs against the expected formats:
+//  const TLVNode *node;
+//  int error = TLVTags::checkTLVs(tlvs, &node);
+//
+#ifndef __TLVTAGS_H__
+#define __TLVTAGS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "tlv.h"
+
+//
+// Information for a tag
+//
+struct TLVTagInfo {
+    uint16_t tag;
+    uint8_t format;             // TLVTags::FORMAT_*
+    uint8_t min_length;         // Value length limits in bytes
+    uint8_t max_length;
+    const char *name;           // Stored in flash
+};
+
+class TLVTags {
+public:
+    // Value formats, EMV Book 3 section 4.3
+    static const uint8_t FORMAT_B = 0;          // Binary
+    static const uint8_t FORMAT_N = 1;          // Numeric, packed BCD
+    static const uint8_t FORMAT_CN = 2;         // Compressed numeric
+    static const uint8_t FORMAT_AN = 3;         // Alphanumeric
+    static const uint8_t FORMAT_ANS = 4;        // Alphanumeric special
+    static const uint8_t FORMAT_TEMPLATE = 5;   // Constructed TLV
+
+    // Look up a tag. Returns false if not in the dictionary.
+    static bool find(uint16_t tag, TLVTagInfo *info);
+
+    // Name of a tag, stored in flash. NULL if not in the dictionary.
+    // Usable as a TLVTagName for TLVS::printTLV and TLVDump.
+    static const char* name(uint16_t tag);
+
+    // Check a TLV value against the expected format and length.
+    // Returns TLVS::ERROR_TAG_FORMAT on a mismatch.
+    // Tags not in the dictionary are not checked.
+    static int checkTLV(const TLVNode *node);
+
+    // Check all TLVs, including nested TLVs.
+    // Returns the first error, and optionally the TLV with the error.
+    static int checkTLVs(const TLVS &tlvs, const TLVNode **bad_node = NULL);
+
+private:
+    static int checkHelper(const TLVNode *node, const TLVNode **bad_node);
+};
+
+#endif